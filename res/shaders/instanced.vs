@@ -0,0 +1,24 @@
+// Same as simple.vs for Mesh::RenderInstanced: the model comes from the instance instead of a uniform
+attribute mat4 a_model;
+uniform mat4 u_viewprojection;
+
+// Variables to pass to the fragment shader
+varying vec2 v_uv;
+varying vec3 v_world_position;
+varying vec3 v_world_normal;
+
+void main()
+{	
+	v_uv = gl_MultiTexCoord0.xy;
+
+	// Convert local position and normal to world space with the model of this instance
+	vec3 world_position = (a_model * vec4( gl_Vertex.xyz, 1.0)).xyz;
+	vec3 world_normal = (a_model * vec4( gl_Normal.xyz, 0.0)).xyz;
+
+	// Pass them to the fragment shader interpolated
+	v_world_position = world_position;
+	v_world_normal = world_normal;
+
+	// Project the vertex using the view projection matrix
+	gl_Position = u_viewprojection * vec4(world_position, 1.0);
+}
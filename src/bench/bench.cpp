@@ -0,0 +1,365 @@
+/*
+	+ Benchmark of the Image rasterization primitives (cg_bench target).
+	+ Every primitive is timed for several shape sizes and framebuffer resolutions and the results
+	  are printed as JSON in the standard output, so two releases can be compared automatically.
+
+	Usage: cg_bench [--quick] [--filter <primitive>] [--max-resolution <name>] [--threads <n>] [--rgba] [--particles <n>] [--vertices <n>]
+*/
+
+#include "main/includes.h"
+#include "framework/image.h"
+#include "framework/tilerenderer.h"
+#include "framework/camera.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+struct Resolution {
+	const char* name;
+	unsigned int width;
+	unsigned int height;
+};
+
+static const Resolution resolutions[] = {
+	{ "720p", 1280, 720 },
+	{ "1080p", 1920, 1080 },
+	{ "1440p", 2560, 1440 },
+	{ "4K", 3840, 2160 },
+	{ "8K", 7680, 4320 },
+};
+
+static const int shape_sizes[] = { 8, 64, 256, 1024 };
+
+struct BenchResult {
+	std::string primitive;
+	const Resolution* resolution;
+	int size;					// Shape size in pixels (0 for whole image operations)
+	int samples;				// Number of timed frames
+	int ops_per_sample;			// Calls to the primitive per frame
+	double pixels_per_op;		// Pixels covered by one call
+	double ns_per_pixel;
+	double pixels_per_sec;
+	double p50_ms, p90_ms, p99_ms;	// Frame time percentiles
+};
+
+struct BenchOptions {
+	int samples = 15;
+	double min_sample_ms = 2.0;
+	std::string filter;
+	unsigned int max_pixels = 7680 * 4320;
+	int threads = 0;			// Worker threads of the tile renderer and the particles (0 = all the cores)
+	Image::PixelFormat format = Image::PIXEL_RGB8;
+	int particles = 1 << 20;	// Particles of the ParticleUpdate/ParticleRender emitter
+	int vertices = 1 << 20;		// Vertices projected by ProjectVector/ProjectVectors
+};
+
+// Deterministic generator so every run draws exactly the same shapes
+struct BenchRandom {
+	unsigned int state = 12345;
+	unsigned int Next() { state = state * 1664525u + 1013904223u; return state >> 8; }
+	int Range(int n) { return n > 0 ? (int)(Next() % (unsigned int)n) : 0; }
+};
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double ElapsedMs(BenchClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(BenchClock::now() - start).count();
+}
+
+static double Percentile(std::vector<double> values, double p)
+{
+	std::sort(values.begin(), values.end());
+	size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+	return values[std::min(index, values.size() - 1)];
+}
+
+// Times op(i) in frames of ops_per_sample calls, ops_per_sample is calibrated so a frame lasts at least min_sample_ms
+template <typename F>
+static BenchResult RunBench(const BenchOptions& options, const char* primitive, const Resolution& resolution, int size, double pixels_per_op, F op)
+{
+	int ops = 1;
+	while (ops < (1 << 20))
+	{
+		BenchClock::time_point start = BenchClock::now();
+		for (int i = 0; i < ops; ++i)
+			op(i);
+		if (ElapsedMs(start) >= options.min_sample_ms)
+			break;
+		ops *= 2;
+	}
+
+	std::vector<double> times;
+	for (int s = 0; s < options.samples; ++s)
+	{
+		BenchClock::time_point start = BenchClock::now();
+		for (int i = 0; i < ops; ++i)
+			op(i);
+		times.push_back(ElapsedMs(start));
+	}
+
+	double total_ms = 0.0;
+	for (size_t i = 0; i < times.size(); ++i)
+		total_ms += times[i];
+	double total_pixels = pixels_per_op * ops * options.samples;
+
+	BenchResult result;
+	result.primitive = primitive;
+	result.resolution = &resolution;
+	result.size = size;
+	result.samples = options.samples;
+	result.ops_per_sample = ops;
+	result.pixels_per_op = pixels_per_op;
+	result.ns_per_pixel = total_ms * 1e6 / total_pixels;
+	result.pixels_per_sec = total_pixels / (total_ms * 1e-3);
+	result.p50_ms = Percentile(times, 0.50);
+	result.p90_ms = Percentile(times, 0.90);
+	result.p99_ms = Percentile(times, 0.99);
+
+	std::cerr << primitive << " " << resolution.name << " size " << size << ": " << result.ns_per_pixel << " ns/pixel" << std::endl;
+	return result;
+}
+
+static bool Selected(const BenchOptions& options, const char* primitive)
+{
+	return options.filter.empty() || options.filter == primitive;
+}
+
+// Draws a frame with lines, rects, triangles and circles (same calls for an Image and for a TileRenderer)
+template <typename T>
+static void DrawMixedFrame(T& target, const std::vector<int>& xs, const std::vector<int>& ys, int s)
+{
+	target.Fill(Color::BLACK);
+	for (int i = 0; i < (int)xs.size(); ++i)
+	{
+		int x = xs[i], y = ys[i];
+		switch (i & 3)
+		{
+		case 0: target.DrawLineDDA(x, y, x + s, y + s / 3, Color::WHITE); break;
+		case 1: target.DrawRect(x, y, s, s, Color::RED, 1, true, Color::GREEN); break;
+		case 2: target.DrawTriangle(Vector2((float)x, (float)y), Vector2((float)(x + s), (float)y), Vector2((float)x, (float)(y + s)), Color::BLUE, true, Color::CYAN); break;
+		case 3: target.DrawCircle(x + s / 2, y + s / 2, s / 2, Color::YELLOW, 1, true, Color::PURPLE); break;
+		}
+	}
+}
+
+// Benchmarks every primitive for one framebuffer resolution
+static void BenchResolution(const BenchOptions& options, ThreadPool& pool, const Resolution& res, std::vector<BenchResult>& results)
+{
+	Image framebuffer(res.width, res.height, options.format);
+	const int W = (int)res.width;
+	const int H = (int)res.height;
+	const double pi = 3.14159265359;
+
+	for (size_t k = 0; k < sizeof(shape_sizes) / sizeof(int); ++k)
+	{
+		const int s = shape_sizes[k];
+		if (s + 8 >= H)
+			continue;
+
+		// Random positions that keep the whole shape (and its border) inside the framebuffer
+		BenchRandom rnd;
+		std::vector<int> xs(1024), ys(1024);
+		for (size_t i = 0; i < xs.size(); ++i) {
+			xs[i] = 4 + rnd.Range(W - s - 8);
+			ys[i] = 4 + rnd.Range(H - s - 8);
+		}
+		#define BENCH_X(i) xs[(i) & 1023]
+		#define BENCH_Y(i) ys[(i) & 1023]
+
+		if (Selected(options, "DrawLineDDA"))
+			results.push_back(RunBench(options, "DrawLineDDA", res, s, s + 1.0, [&](int i) {
+				framebuffer.DrawLineDDA(BENCH_X(i), BENCH_Y(i), BENCH_X(i) + s, BENCH_Y(i) + s / 2, Color::WHITE);
+			}));
+
+		if (Selected(options, "DrawRect"))
+			results.push_back(RunBench(options, "DrawRect", res, s, 4.0 * s, [&](int i) {
+				framebuffer.DrawRect(BENCH_X(i), BENCH_Y(i), s, s, Color::RED, 1, false, Color::GREEN);
+			}));
+
+		if (Selected(options, "DrawRectFilled"))
+			results.push_back(RunBench(options, "DrawRectFilled", res, s, (double)s * s, [&](int i) {
+				framebuffer.DrawRect(BENCH_X(i), BENCH_Y(i), s, s, Color::RED, 1, true, Color::GREEN);
+			}));
+
+		if (Selected(options, "DrawTriangle"))
+			results.push_back(RunBench(options, "DrawTriangle", res, s, 3.4 * s, [&](int i) {
+				framebuffer.DrawTriangle(Vector2((float)BENCH_X(i), (float)BENCH_Y(i)), Vector2((float)(BENCH_X(i) + s), (float)BENCH_Y(i)), Vector2((float)BENCH_X(i), (float)(BENCH_Y(i) + s)), Color::BLUE, false, Color::CYAN);
+			}));
+
+		if (Selected(options, "DrawTriangleFilled"))
+			results.push_back(RunBench(options, "DrawTriangleFilled", res, s, 0.5 * s * s, [&](int i) {
+				framebuffer.DrawTriangle(Vector2((float)BENCH_X(i), (float)BENCH_Y(i)), Vector2((float)(BENCH_X(i) + s), (float)BENCH_Y(i)), Vector2((float)BENCH_X(i), (float)(BENCH_Y(i) + s)), Color::BLUE, true, Color::CYAN);
+			}));
+
+		if (Selected(options, "DrawTriangleFilledHalfSpace")) {
+			framebuffer.triangle_rasterizer = Image::RASTERIZER_HALFSPACE;
+			results.push_back(RunBench(options, "DrawTriangleFilledHalfSpace", res, s, 0.5 * s * s, [&](int i) {
+				framebuffer.DrawTriangle(Vector2((float)BENCH_X(i), (float)BENCH_Y(i)), Vector2((float)(BENCH_X(i) + s), (float)BENCH_Y(i)), Vector2((float)BENCH_X(i), (float)(BENCH_Y(i) + s)), Color::BLUE, true, Color::CYAN);
+			}));
+			framebuffer.triangle_rasterizer = Image::RASTERIZER_SCANLINE;
+		}
+
+		const int r = s / 2;
+		if (Selected(options, "DrawCircle"))
+			results.push_back(RunBench(options, "DrawCircle", res, s, 2.0 * pi * r, [&](int i) {
+				framebuffer.DrawCircle(BENCH_X(i) + r, BENCH_Y(i) + r, r, Color::YELLOW, 1, false, Color::PURPLE);
+			}));
+
+		if (Selected(options, "DrawCircleFilled"))
+			results.push_back(RunBench(options, "DrawCircleFilled", res, s, pi * r * r, [&](int i) {
+				framebuffer.DrawCircle(BENCH_X(i) + r, BENCH_Y(i) + r, r, Color::YELLOW, 1, true, Color::PURPLE);
+			}));
+
+		if (Selected(options, "MidpointCircleFill"))
+			results.push_back(RunBench(options, "MidpointCircleFill", res, s, pi * r * r, [&](int i) {
+				framebuffer.MidpointCircleFill(BENCH_X(i) + r, BENCH_Y(i) + r, r, Color::PURPLE);
+			}));
+
+		#undef BENCH_X
+		#undef BENCH_Y
+	}
+
+	// Whole image operations
+	const double image_pixels = (double)W * H;
+
+	if (Selected(options, "Fill"))
+		results.push_back(RunBench(options, "Fill", res, 0, image_pixels, [&](int i) {
+			framebuffer.Fill(i & 1 ? Color::BLACK : Color::GRAY);
+		}));
+
+	if (Selected(options, "Scale"))
+		results.push_back(RunBench(options, "Scale", res, 0, image_pixels, [&](int i) {
+			framebuffer.Scale(res.width, res.height);
+		}));
+
+	if (Selected(options, "FlipY"))
+		results.push_back(RunBench(options, "FlipY", res, 0, image_pixels, [&](int i) {
+			framebuffer.FlipY();
+		}));
+
+	// Whole frames with many primitives, drawn directly and with the tile renderer
+	const int frame_primitives = 4096;
+	const int fs = 64;
+	BenchRandom rnd;
+	std::vector<int> fxs(frame_primitives), fys(frame_primitives);
+	for (int i = 0; i < frame_primitives; ++i) {
+		fxs[i] = 4 + rnd.Range(W - fs - 8);
+		fys[i] = 4 + rnd.Range(H - fs - 8);
+	}
+
+	if (Selected(options, "FrameMixed"))
+		results.push_back(RunBench(options, "FrameMixed", res, fs, image_pixels, [&](int i) {
+			DrawMixedFrame(framebuffer, fxs, fys, fs);
+		}));
+
+	if (Selected(options, "FrameMixedTiled")) {
+		TileRenderer tiles(&pool);
+		results.push_back(RunBench(options, "FrameMixedTiled", res, fs, image_pixels, [&](int i) {
+			DrawMixedFrame(tiles, fxs, fys, fs);
+			tiles.Render(framebuffer);
+		}));
+	}
+
+	// A full emitter with options.particles particles that cover the framebuffer (ns_per_pixel is per particle here)
+	if (Selected(options, "ParticleUpdate") || Selected(options, "ParticleRender")) {
+		ParticleEmitterParams params;
+		params.capacity = options.particles;
+		ParticleSystem particles(NULL, &pool);
+		particles.Init(params, W, H);
+
+		if (Selected(options, "ParticleUpdate"))
+			results.push_back(RunBench(options, "ParticleUpdate", res, 0, options.particles, [&](int i) {
+				particles.Update(1.0f / 60.0f);
+			}));
+
+		if (Selected(options, "ParticleRender"))
+			results.push_back(RunBench(options, "ParticleRender", res, 0, options.particles, [&](int i) {
+				particles.Render(&framebuffer);
+			}));
+	}
+
+	// options.vertices random vertices in front of the camera, projected to the framebuffer (ns_per_pixel is per vertex here)
+	if (Selected(options, "ProjectVector") || Selected(options, "ProjectVectors")) {
+		Camera camera;
+		camera.LookAt(Vector3(0.0f, 0.0f, 3.0f), Vector3(0.0f, 0.0f, 0.0f), Vector3::UP);
+		camera.SetPerspective(45.0f, W / (float)H, 0.1f, 100.0f);
+
+		BenchRandom rnd;
+		std::vector<Vector3> vertices(options.vertices);
+		for (size_t i = 0; i < vertices.size(); ++i)
+			vertices[i] = Vector3(rnd.Range(2001) * 0.001f - 1.0f, rnd.Range(2001) * 0.001f - 1.0f, rnd.Range(2001) * 0.001f - 1.0f);
+
+		std::vector<Vector3> projected(vertices.size());
+		if (Selected(options, "ProjectVector"))		// One vertex at a time (the baseline)
+			results.push_back(RunBench(options, "ProjectVector", res, 0, options.vertices, [&](int i) {
+				bool negZ;
+				for (size_t k = 0; k < vertices.size(); ++k)
+					projected[k] = camera.ProjectVector(vertices[k], negZ);
+			}));
+
+		ProjectedVertices batch;
+		if (Selected(options, "ProjectVectors"))
+			results.push_back(RunBench(options, "ProjectVectors", res, 0, options.vertices, [&](int i) {
+				camera.ProjectVectors(vertices, batch, NULL, W, H);
+			}));
+	}
+}
+
+static void PrintJSON(const std::vector<BenchResult>& results, Image::PixelFormat format)
+{
+	printf("{\n\t\"benchmark\": \"cg_bench\",\n\t\"pixel_format\": \"%s\",\n\t\"results\": [\n", format == Image::PIXEL_RGBA8 ? "RGBA8" : "RGB8");
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const BenchResult& r = results[i];
+		printf("\t\t{ \"primitive\": \"%s\", \"resolution\": \"%s\", \"width\": %u, \"height\": %u, \"size\": %d, "
+			"\"samples\": %d, \"ops_per_sample\": %d, \"pixels_per_op\": %.1f, "
+			"\"ns_per_pixel\": %.4f, \"pixels_per_sec\": %.0f, "
+			"\"frame_ms\": { \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f } }%s\n",
+			r.primitive.c_str(), r.resolution->name, r.resolution->width, r.resolution->height, r.size,
+			r.samples, r.ops_per_sample, r.pixels_per_op,
+			r.ns_per_pixel, r.pixels_per_sec,
+			r.p50_ms, r.p90_ms, r.p99_ms, i + 1 < results.size() ? "," : "");
+	}
+	printf("\t]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions options;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--quick") == 0) { options.samples = 5; options.min_sample_ms = 0.5; }
+		else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) options.filter = argv[++i];
+		else if (strcmp(argv[i], "--rgba") == 0) options.format = Image::PIXEL_RGBA8;
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) options.threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--particles") == 0 && i + 1 < argc) options.particles = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--vertices") == 0 && i + 1 < argc) options.vertices = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--max-resolution") == 0 && i + 1 < argc)
+		{
+			const char* name = argv[++i];
+			for (size_t k = 0; k < sizeof(resolutions) / sizeof(Resolution); ++k)
+				if (strcmp(resolutions[k].name, name) == 0)
+					options.max_pixels = resolutions[k].width * resolutions[k].height;
+		}
+	}
+
+	ThreadPool pool(options.threads);
+	std::cerr << "Worker threads: " << pool.GetNumThreads() << std::endl;
+
+	std::vector<BenchResult> results;
+	for (size_t k = 0; k < sizeof(resolutions) / sizeof(Resolution); ++k)
+	{
+		if (resolutions[k].width * resolutions[k].height > options.max_pixels)
+			continue;
+		BenchResolution(options, pool, resolutions[k], results);
+	}
+
+	PrintJSON(results, options.format);
+	return 0;
+}
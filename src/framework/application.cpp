@@ -9,19 +9,24 @@
 
 ParticleSystem particleSystem;
 
-Application::Application(const char* caption, int width, int height)
+Application::Application(const char* caption, int width, int height, bool headless)
 {
-	this->window = createWindow(caption, width, height);
+	this->headless = headless;
 
-	int w,h;
-	SDL_GetWindowSize(window,&w,&h);
+	int w = width, h = height;
+	if (!headless)
+	{
+		this->window = createWindow(caption, width, height);
+		SDL_GetWindowSize(window,&w,&h);
+	}
 
 	this->mouse_state = 0;
 	this->time = 0.f;
 	this->window_width = w;
 	this->window_height = h;
-	this->keystate = SDL_GetKeyboardState(nullptr);
+	this->keystate = headless ? nullptr : SDL_GetKeyboardState(nullptr);
 
+	this->framebuffer.SetFormat(Image::PIXEL_RGBA8);		// 4 bytes por pxel: filas alineadas y subida directa como GL_RGBA
 	this->framebuffer.Resize(w, h);
 
 	borderWidth = 1;		// Inicializamos el grosor del borde a 1
@@ -35,13 +40,58 @@ Application::~Application()
 void Application::Init(void)
 {
 	std::cout << "Initiating app..." << std::endl;
-	particleSystem.Init();		// Con esto incializamos el sistema de creacin de partculas
+	if (!headless)
+		presenter.Init();		// Sin ventana no hay contexto de GL
+	particleSystem.Init(framebuffer.width, framebuffer.height);		// Con esto incializamos el sistema de creacin de partculas
+
+	// Los tres bustos en fila, cada uno de un color (las mallas se cargan al entrar en el modo 7, ver LoadMeshes)
+	const Color mesh_colors[3] = { Color(255, 190, 160), Color(160, 220, 255), Color(200, 255, 170) };
+	for (int i = 0; i < 3; ++i) {
+		entities[i] = Entity(&meshes[i], mesh_colors[i]);
+		entities[i].model.SetTranslation(-0.45f + 0.45f * i, 0.0f, 0.0f);
+	}
+	camera.LookAt(Vector3(0.0f, 0.28f, 1.35f), Vector3(0.0f, 0.28f, 0.0f), Vector3::UP);
+	camera.SetPerspective(45.0f, framebuffer.width / (float)std::max(1u, framebuffer.height), 0.01f, 100.0f);
 }
 
 // Render one frame
 void Application::Render(void)
 {
-	framebuffer.Fill(Color::BLACK);
+	if (SceneChanged())
+		DrawScene();		// Si nada ha cambiado el framebuffer del fotograma anterior sigue sirviendo
+
+	if (!headless)
+		presenter.Present(framebuffer);		// Finalmente se sube (solo lo que ha cambiado) y se pinta la imagen (sin ventana no hay nada que subir a GL)
+}
+
+// Las partculas se mueven en cada fotograma; el resto de modos solo cambia con las teclas o el tamao de la ventana
+bool Application::SceneChanged() const
+{
+	return currentMode == 6 || currentMode == 7 || currentMode != drawnMode || isFilled != drawnFilled || borderWidth != drawnBorderWidth ||
+		(int)framebuffer.triangle_rasterizer != drawnRasterizer || framebuffer.width != drawnWidth || framebuffer.height != drawnHeight;
+}
+
+// Dibuja la escena borrando solo lo que se pint en el fotograma anterior. Al terminar framebuffer.dirty_rects
+// tiene todo lo que ha cambiado (lo borrado y lo pintado), que es lo que sube el presenter
+void Application::DrawScene()
+{
+	bool resized = framebuffer.width != drawnWidth || framebuffer.height != drawnHeight;
+	bool animated = currentMode == 6 || currentMode == 7;		// Las partculas y los modelos que giran ocupan toda la pantalla, no compensa seguir las regiones
+
+	framebuffer.ClearDirtyRects();
+	framebuffer.track_dirty = true;
+	if (resized || animated) {
+		framebuffer.Fill(Color::BLACK);		// Marca toda la imagen
+		framebuffer.track_dirty = !animated;
+	}
+	else {
+		for (size_t i = 0; i < drawnRects.size(); ++i) {
+			const Image::DirtyRect& r = drawnRects[i];
+			framebuffer.FillRect(r.x0, r.y0, r.x1 - r.x0 + 1, r.y1 - r.y0 + 1, Color::BLACK);
+		}
+	}
+	std::vector<Image::DirtyRect> cleared = framebuffer.dirty_rects;
+	framebuffer.ClearDirtyRects();
 	
 	if (drawLines) {
 		framebuffer.DrawLineDDA(300, 300, 400, 400, Color::WHITE);		// Dibujamos una lnea
@@ -62,8 +112,49 @@ void Application::Render(void)
 	else if (currentMode == 6) {
 		particleSystem.Render(&framebuffer);		// Aqu renderizamos el sistema de particulas para mostrarlas por pantalla
 	}
+	else if (currentMode == 7) {
+		DrawEntities();
+	}
 
-	framebuffer.Render();		// Finalmente se va renderizando la imagen
+	// Lo pintado se borrar en el siguiente fotograma; lo borrado ahora tambin ha cambiado
+	drawnRects = animated ? cleared : framebuffer.dirty_rects;
+	framebuffer.track_dirty = true;
+	for (size_t i = 0; i < cleared.size(); ++i)
+		framebuffer.MarkDirty(cleared[i].x0, cleared[i].y0, cleared[i].x1, cleared[i].y1);
+
+	drawnMode = currentMode;
+	drawnFilled = isFilled;
+	drawnBorderWidth = borderWidth;
+	drawnRasterizer = (int)framebuffer.triangle_rasterizer;
+	drawnWidth = framebuffer.width;
+	drawnHeight = framebuffer.height;
+}
+
+// Carga los modelos del modo 7 una sola vez, as los dems modos no leen los OBJ (ni escriben sus cachs)
+void Application::LoadMeshes()
+{
+	if (meshesLoaded)
+		return;
+
+	const char* mesh_names[3] = { "meshes/anna.obj", "meshes/cleo.obj", "meshes/lee.obj" };
+	for (int i = 0; i < 3; ++i)
+		meshes[i].LoadOBJ(mesh_names[i]);
+	meshesLoaded = true;
+}
+
+// Pinta los modelos 3D con el pipeline de la CPU (el z-buffer se limpia a 1, el plano lejano)
+void Application::DrawEntities()
+{
+	LoadMeshes();
+	if (zbuffer.width != framebuffer.width || zbuffer.height != framebuffer.height)
+		zbuffer.Resize(framebuffer.width, framebuffer.height);
+	zbuffer.Fill(1.0f);
+
+	camera.SetAspectRatio(framebuffer.width / (float)std::max(1u, framebuffer.height));		// Por si ha cambiado el tamao de la ventana
+	camera.UpdateProjectionMatrix();
+
+	for (int i = 0; i < 3; ++i)
+		entities[i].Render(&framebuffer, &camera, &zbuffer);
 }
 
 // Called after render
@@ -72,6 +163,14 @@ void Application::Update(float dt)
 	if (currentMode == 6) {
 		particleSystem.Update(dt);		// Aqu actualizamos el sistema de partculas
 	}
+	else if (currentMode == 7) {
+		for (int i = 0; i < 3; ++i) {		// Cada modelo gira sobre s mismo, en sentidos alternos
+			Matrix44& model = entities[i].model;
+			Vector3 position(model.m[12], model.m[13], model.m[14]);
+			model.SetRotation((i % 2 ? -0.5f : 0.5f) * time, Vector3::UP);
+			model.m[12] = position.x; model.m[13] = position.y; model.m[14] = position.z;
+		}
+	}
 }
 
 //keyboard press event 
@@ -88,62 +187,48 @@ void Application::OnKeyPressed( SDL_KeyboardEvent event )
 		case SDLK_KP_MINUS: borderWidth = std::max(1, borderWidth - 1); break;		// Reducimos el grosor del borde asegurdonos que sea mayor que 1
 
 		case SDLK_KP_1:
-		case SDLK_1: {				// Si pulsamos la tecla 1 tanto de normal como en el KeyPad...
-			drawLines = true;
-			drawRectangles = false;
-			drawCircles = false;
-			drawTriangles = false;
-			currentMode = 1;		// Entramos en el modo 1 que dibuja lneas
-			break;
-		}
+		case SDLK_1: SetMode(1); break;		// Si pulsamos la tecla 1 tanto de normal como en el KeyPad entramos en el modo 1 que dibuja lneas
 
 		case SDLK_KP_2:
-		case SDLK_2: {				// Lo mismo con el 2 y cono los siguientes nmeros, pero cada uno con su funcin
-			drawLines = false;
-			drawRectangles = true;
-			drawCircles = false;
-			drawTriangles = false;
-			currentMode = 2;
-			break;
-		}
+		case SDLK_2: SetMode(2); break;		// Lo mismo con el 2 y con los siguientes nmeros, pero cada uno con su funcin
 
 		case SDLK_KP_3:
-		case SDLK_3: {
-			drawLines = false;
-			drawRectangles = false;
-			drawCircles = true;
-			drawTriangles = false;
-			currentMode = 3;
-			break;
-		}
+		case SDLK_3: SetMode(3); break;
 
 		case SDLK_KP_4:
-		case SDLK_4: {
-			drawLines = false;
-			drawRectangles = false;
-			drawCircles = false;
-			drawTriangles = true;
-			currentMode = 4;
-			break;
-		}
+		case SDLK_4: SetMode(4); break;
 
 		case SDLK_KP_6:
-		case SDLK_6: {				// En este modo no se dibujan figuras, ya que este ser el encargado de las partculas
-			drawLines = false;
-			drawRectangles = false;
-			drawCircles = false;
-			drawTriangles = false;
-			currentMode = 6;
-			break;
-		}
+		case SDLK_6: SetMode(6); break;		// En este modo no se dibujan figuras, ya que este ser el encargado de las partculas
+
+		case SDLK_KP_7:
+		case SDLK_7: SetMode(7); break;		// Modelos 3D con z-buffer
 
 		case SDLK_f: {				// Este cambia el estado de relleno de las figuras que haya en pantalla en ese momento
 			isFilled = !isFilled;
 			break;
 		}
+
+		case SDLK_h: {				// Alterna el algoritmo de relleno de tringulos (scanlines o funciones de arista)
+			framebuffer.triangle_rasterizer = framebuffer.triangle_rasterizer == Image::RASTERIZER_SCANLINE ? Image::RASTERIZER_HALFSPACE : Image::RASTERIZER_SCANLINE;
+			break;
+		}
 	}
 }
 
+// Cambia el modo de dibujo (lo usan las teclas y el modo headless desde la lnea de comandos)
+void Application::SetMode(int mode)
+{
+	drawLines = (mode == 1);
+	drawRectangles = (mode == 2);
+	drawCircles = (mode == 3);
+	drawTriangles = (mode == 4);
+	currentMode = mode;
+
+	if (mode == 7)
+		LoadMeshes();
+}
+
 void Application::OnMouseButtonDown( SDL_MouseButtonEvent event )
 {
 	if (event.button == SDL_BUTTON_LEFT) {
@@ -7,6 +7,9 @@
 #include "main/includes.h"
 #include "framework.h"
 #include "image.h"
+#include "presenter.h"
+#include "camera.h"
+#include "entity.h"
 
 class Application
 {
@@ -25,6 +28,9 @@ public:
 	int window_width;
 	int window_height;
 
+	// Headless mode: no SDL window nor GL context, the framebuffer is only rendered on the CPU
+	bool headless = false;
+
 	float time;
 
 	// Input
@@ -43,8 +49,17 @@ public:
 	// CPU Global framebuffer
 	Image framebuffer;
 
+	// Sube el framebuffer a una textura (solo las filas modificadas) y la pinta en la ventana
+	FramebufferPresenter presenter;
+
+	// Escena 3D del modo 7, pintada en la CPU con el z-buffer (tambin funciona sin ventana)
+	Camera camera;
+	FloatImage zbuffer;
+	Mesh meshes[3];
+	Entity entities[3];
+
 	// Constructor and main methods
-	Application(const char* caption, int width, int height);
+	Application(const char* caption, int width, int height, bool headless = false);
 	~Application();
 
 	void Init( void );
@@ -52,8 +67,11 @@ public:
 	void Update( float dt );
 
 	// Other methods to control the app
+	void SetMode(int mode);
+
 	void SetWindowSize(int width, int height) {
-		glViewport( 0,0, width, height );
+		if (!headless)
+			glViewport( 0,0, width, height );
 		this->window_width = width;
 		this->window_height = height;
 		this->framebuffer.Resize(width, height);
@@ -61,6 +79,8 @@ public:
 
 	Vector2 GetWindowSize()
 	{
+		if (headless)
+			return Vector2(float(window_width), float(window_height));
 		int w,h;
 		SDL_GetWindowSize(window,&w,&h);
 		return Vector2(float(w), float(h));
@@ -69,4 +89,19 @@ public:
 private: 
 	int borderWidth;	// Definimos una variable para incrementar o reducir el grosor del borde del rectngulo
 	int currentMode = 0;		//Definimos currentMode para utilizarlo en la deteccin de teclas
+
+	// Estado con el que se dibuj el ltimo fotograma: si no cambia (y no hay animacin) el framebuffer ya es correcto
+	int drawnMode = -1;
+	bool drawnFilled = false;
+	int drawnBorderWidth = 0;
+	int drawnRasterizer = -1;
+	unsigned int drawnWidth = 0, drawnHeight = 0;
+	std::vector<Image::DirtyRect> drawnRects;	// Lo que se pint, es lo nico que hay que borrar en el siguiente
+
+	bool meshesLoaded = false;		// Los modelos del modo 7 se cargan la primera vez que se usan
+
+	bool SceneChanged() const;
+	void DrawScene();
+	void LoadMeshes();
+	void DrawEntities();
 };
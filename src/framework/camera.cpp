@@ -3,6 +3,11 @@
 #include "main/includes.h"
 #include <iostream>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define CAMERA_USE_SSE2
+#endif
+
 Camera::Camera()
 {
 	view_matrix.SetIdentity();
@@ -29,6 +34,122 @@ Vector3 Camera::ProjectVector(Vector3 pos, bool& negZ)
 		return result.GetVector3() / result.w;
 }
 
+void ProjectedVertices::Resize(size_t count)
+{
+	this->count = count;
+	size_t padded = (count + 3) & ~(size_t)3;
+	if (clip_flags.size() >= padded)
+		return;
+	x.resize(padded); y.resize(padded); z.resize(padded);
+	clip_x.resize(padded); clip_y.resize(padded); clip_z.resize(padded); clip_w.resize(padded);
+	clip_flags.resize(padded);
+}
+
+// Same operations in the same order as ProjectVector, so both give the same numbers
+static inline void ProjectOne(const Matrix44& m, const Vector3& v, float sx, float ox, float sy, float oy, float sz, float oz, ProjectedVertices& r, size_t i)
+{
+	float cx = m.m[0] * v.x + m.m[4] * v.y + m.m[8] * v.z + m.m[12];
+	float cy = m.m[1] * v.x + m.m[5] * v.y + m.m[9] * v.z + m.m[13];
+	float cz = m.m[2] * v.x + m.m[6] * v.y + m.m[10] * v.z + m.m[14];
+	float cw = m.m[3] * v.x + m.m[7] * v.y + m.m[11] * v.z + m.m[15];
+
+	r.clip_x[i] = cx; r.clip_y[i] = cy; r.clip_z[i] = cz; r.clip_w[i] = cw;
+	r.clip_flags[i] = (unsigned char)((cx < -cw ? ProjectedVertices::CLIP_LEFT : 0) | (cx > cw ? ProjectedVertices::CLIP_RIGHT : 0) |
+		(cy < -cw ? ProjectedVertices::CLIP_BOTTOM : 0) | (cy > cw ? ProjectedVertices::CLIP_TOP : 0) |
+		(cz < -cw ? ProjectedVertices::CLIP_NEAR : 0) | (cz > cw ? ProjectedVertices::CLIP_FAR : 0));
+
+	r.x[i] = cx / cw * sx + ox;
+	r.y[i] = cy / cw * sy + oy;
+	r.z[i] = cz / cw * sz + oz;
+}
+
+void Camera::ProjectVectors(const std::vector<Vector3>& positions, ProjectedVertices& result, const Matrix44* model, int viewport_width, int viewport_height)
+{
+	ProjectVectors(positions.empty() ? NULL : &positions[0], positions.size(), sizeof(Vector3), result, model, viewport_width, viewport_height);
+}
+
+void Camera::ProjectVectors(const Vector3* positions, size_t count, size_t stride, ProjectedVertices& result, const Matrix44* model, int viewport_width, int viewport_height)
+{
+	result.Resize(count);
+	if (count == 0)
+		return;
+
+	const Matrix44 m = model ? viewprojection_matrix * (*model) : viewprojection_matrix;
+
+	// Viewport transform after the divide (identity when there is no viewport)
+	const bool viewport = viewport_width > 0 && viewport_height > 0;
+	const float sx = viewport ? viewport_width * 0.5f : 1.0f, ox = viewport ? viewport_width * 0.5f : 0.0f;
+	const float sy = viewport ? viewport_height * 0.5f : 1.0f, oy = viewport ? viewport_height * 0.5f : 0.0f;
+	const float sz = viewport ? 0.5f : 1.0f, oz = viewport ? 0.5f : 0.0f;
+
+	const char* src = (const char*)positions;
+	size_t i = 0;
+#ifdef CAMERA_USE_SSE2
+	// Packed xyz vectors, or vectors followed by at least one more float (like the position of a MeshVertex)
+	const bool packed_xyz = stride == 3 * sizeof(float) && sizeof(Vector3) == 3 * sizeof(float);
+	if (packed_xyz || stride >= 4 * sizeof(float))
+	{
+		__m128 col[4][4];		// Every matrix element in the four lanes
+		for (int c = 0; c < 4; ++c)
+			for (int r = 0; r < 4; ++r)
+				col[c][r] = _mm_set1_ps(m.m[c * 4 + r]);
+		const __m128 vsx = _mm_set1_ps(sx), vox = _mm_set1_ps(ox), vsy = _mm_set1_ps(sy), voy = _mm_set1_ps(oy);
+		const __m128 vsz = _mm_set1_ps(sz), voz = _mm_set1_ps(oz), sign = _mm_set1_ps(-0.0f);
+
+		for (; i + 4 <= count; i += 4, src += 4 * stride)
+		{
+			// Four vertices to one register per component
+			__m128 x, y, z;
+			if (packed_xyz)
+			{
+				// Three registers with xyz xyz xyz xyz
+				const float* f = (const float*)src;
+				__m128 a = _mm_loadu_ps(f), b = _mm_loadu_ps(f + 4), c = _mm_loadu_ps(f + 8);
+				x = _mm_shuffle_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 3, 0)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 1, 0));
+				y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+				z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+			}
+			else
+			{
+				// One register per vertex (the fourth float is not used) and a 4x4 transpose
+				__m128 a = _mm_loadu_ps((const float*)src), b = _mm_loadu_ps((const float*)(src + stride));
+				__m128 c = _mm_loadu_ps((const float*)(src + 2 * stride)), d = _mm_loadu_ps((const float*)(src + 3 * stride));
+				_MM_TRANSPOSE4_PS(a, b, c, d);
+				x = a; y = b; z = c;
+			}
+
+			__m128 clip[4];
+			for (int r = 0; r < 4; ++r)
+				clip[r] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(col[0][r], x), _mm_mul_ps(col[1][r], y)), _mm_mul_ps(col[2][r], z)), col[3][r]);
+			_mm_storeu_ps(&result.clip_x[i], clip[0]);
+			_mm_storeu_ps(&result.clip_y[i], clip[1]);
+			_mm_storeu_ps(&result.clip_z[i], clip[2]);
+			_mm_storeu_ps(&result.clip_w[i], clip[3]);
+
+			// One bit per plane, then packed to one byte per vertex
+			__m128 w = clip[3], neg_w = _mm_xor_ps(clip[3], sign);
+			__m128i flags = _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(clip[0], neg_w)), _mm_set1_epi32(ProjectedVertices::CLIP_LEFT));
+			flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(clip[0], w)), _mm_set1_epi32(ProjectedVertices::CLIP_RIGHT)));
+			flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(clip[1], neg_w)), _mm_set1_epi32(ProjectedVertices::CLIP_BOTTOM)));
+			flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(clip[1], w)), _mm_set1_epi32(ProjectedVertices::CLIP_TOP)));
+			flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(clip[2], neg_w)), _mm_set1_epi32(ProjectedVertices::CLIP_NEAR)));
+			flags = _mm_or_si128(flags, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(clip[2], w)), _mm_set1_epi32(ProjectedVertices::CLIP_FAR)));
+			flags = _mm_packs_epi32(flags, flags);
+			int packed = _mm_cvtsi128_si32(_mm_packus_epi16(flags, flags));
+			memcpy(&result.clip_flags[i], &packed, 4);
+
+			// Divide (not the reciprocal, to get the same result as ProjectVector) and viewport
+			_mm_storeu_ps(&result.x[i], _mm_add_ps(_mm_mul_ps(_mm_div_ps(clip[0], w), vsx), vox));
+			_mm_storeu_ps(&result.y[i], _mm_add_ps(_mm_mul_ps(_mm_div_ps(clip[1], w), vsy), voy));
+			_mm_storeu_ps(&result.z[i], _mm_add_ps(_mm_mul_ps(_mm_div_ps(clip[2], w), vsz), voz));
+		}
+	}
+#endif
+
+	for (; i < count; ++i, src += stride)
+		ProjectOne(m, *(const Vector3*)src, sx, ox, sy, oy, sz, oz, result, i);
+}
+
 void Camera::Rotate(float angle, const Vector3& axis)
 {
 	Matrix44 R;
@@ -86,18 +207,23 @@ void Camera::UpdateViewMatrix()
 	// Reset Matrix (Identity)
 	view_matrix.SetIdentity();
 
-	// Comment this line to create your own projection matrix!
-	SetExampleViewMatrix();
+	// Computed on the CPU (same result as gluLookAt), so it also works without a GL context
+	Vector3 front = center - eye;
+	front.Normalize();
+	Vector3 side = front.Cross(up);
+	side.Normalize();
+	Vector3 top = side.Cross(front);
 
-	// Remember how to fill a Matrix4x4 (check framework slides)
-	// Careful with the order of matrix multiplications, and be sure to use normalized vectors!
-	
-	// Create the view matrix rotation
-	// ...
-	// view_matrix.M[3][3] = 1.0;
+	// Create the view matrix rotation (the rows are the camera axes)
+	view_matrix.M[0][0] = side.x;	view_matrix.M[1][0] = side.y;	view_matrix.M[2][0] = side.z;
+	view_matrix.M[0][1] = top.x;	view_matrix.M[1][1] = top.y;	view_matrix.M[2][1] = top.z;
+	view_matrix.M[0][2] = -front.x;	view_matrix.M[1][2] = -front.y;	view_matrix.M[2][2] = -front.z;
+	view_matrix.M[3][3] = 1.0;
 
 	// Translate view matrix
-	// ...
+	view_matrix.M[3][0] = -side.Dot(eye);
+	view_matrix.M[3][1] = -top.Dot(eye);
+	view_matrix.M[3][2] = front.Dot(eye);
 
 	UpdateViewProjectionMatrix();
 }
@@ -108,17 +234,23 @@ void Camera::UpdateProjectionMatrix()
 	// Reset Matrix (Identity)
 	projection_matrix.SetIdentity();
 
-	// Comment this line to create your own projection matrix!
-	SetExampleProjectionMatrix();
-
-	// Remember how to fill a Matrix4x4 (check framework slides)
-	
+	// Same matrices as gluPerspective and glOrtho
 	if (type == PERSPECTIVE) {
-		// projection_matrix.M[2][3] = -1;
-		// ...
+		float f = 1.0f / tan(fov * DEG2RAD * 0.5f);
+		projection_matrix.M[0][0] = f / aspect;
+		projection_matrix.M[1][1] = f;
+		projection_matrix.M[2][2] = (far_plane + near_plane) / (near_plane - far_plane);
+		projection_matrix.M[3][2] = 2.0f * far_plane * near_plane / (near_plane - far_plane);
+		projection_matrix.M[2][3] = -1;
+		projection_matrix.M[3][3] = 0;
 	}
 	else if (type == ORTHOGRAPHIC) {
-		// ...
+		projection_matrix.M[0][0] = 2.0f / (right - left);
+		projection_matrix.M[1][1] = 2.0f / (top - bottom);
+		projection_matrix.M[2][2] = -2.0f / (far_plane - near_plane);
+		projection_matrix.M[3][0] = -(right + left) / (right - left);
+		projection_matrix.M[3][1] = -(top + bottom) / (top - bottom);
+		projection_matrix.M[3][2] = -(far_plane + near_plane) / (far_plane - near_plane);
 	} 
 
 	UpdateViewProjectionMatrix();
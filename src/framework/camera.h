@@ -5,8 +5,24 @@
 */
 #pragma once
 
+#include <vector>
 #include "framework.h"
 
+// Output of Camera::ProjectVectors, as structure of arrays (one array per component) so it is written 4 vertices at a time.
+// The arrays are padded to a multiple of 4 and only grow, so the same object can be reused every frame without allocating
+struct ProjectedVertices
+{
+	// Frustum planes a vertex is outside of (clip_flags)
+	enum { CLIP_LEFT = 1, CLIP_RIGHT = 2, CLIP_BOTTOM = 4, CLIP_TOP = 8, CLIP_NEAR = 16, CLIP_FAR = 32 };
+
+	size_t count = 0;
+	std::vector<float> x, y, z;								// After the divide by w (meaningless when w <= 0, those vertices have clip flags)
+	std::vector<float> clip_x, clip_y, clip_z, clip_w;		// Clip space, to clip the triangles that cross the frustum
+	std::vector<unsigned char> clip_flags;
+
+	void Resize(size_t count);
+};
+
 class Camera
 {
 	// OpenGL methods to fill matrices
@@ -56,6 +72,12 @@ public:
 	// so it does not have to be rendered!
 	Vector3 ProjectVector(Vector3 pos, bool& negZ);
 
+	// Projects a whole array of vectors in one call (SIMD when available), transformed first by model if it is not NULL.
+	// Without viewport size x, y and z are the same as ProjectVector; with it x and y are in pixels and z is the depth in [0, 1]
+	void ProjectVectors(const std::vector<Vector3>& positions, ProjectedVertices& result, const Matrix44* model = NULL, int viewport_width = 0, int viewport_height = 0);
+	// Same with count vectors separated by stride bytes (e.g. the positions of interleaved vertices)
+	void ProjectVectors(const Vector3* positions, size_t count, size_t stride, ProjectedVertices& result, const Matrix44* model = NULL, int viewport_width = 0, int viewport_height = 0);
+
 	// Set the info for each projection
 	void SetPerspective(float fov, float aspect, float near_plane, float far_plane);
 	void SetOrthographic(float left, float right, float top, float bottom, float near_plane, float far_plane);
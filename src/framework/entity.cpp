@@ -0,0 +1,272 @@
+#include "entity.h"
+
+// Vertex of a triangle while it is clipped (the color is interpolated with the position)
+struct ClipVertex
+{
+	Vector4 position;
+	Vector3 color;
+};
+
+// Signed distance to each frustum plane in clip space (inside when >= 0), in the order of the ProjectedVertices clip flags
+static inline float PlaneDistance(const Vector4& v, int plane)
+{
+	switch (plane)
+	{
+		case 0: return v.w + v.x;
+		case 1: return v.w - v.x;
+		case 2: return v.w + v.y;
+		case 3: return v.w - v.y;
+		case 4: return v.w + v.z;
+		default: return v.w - v.z;
+	}
+}
+
+// Sutherland-Hodgman in homogeneous space against the planes in mask. Every plane adds one vertex at most,
+// so the result has 9 at most. Returns the number of vertices (less than 3 means nothing is left)
+static int ClipPolygon(ClipVertex* polygon, int count, int mask)
+{
+	ClipVertex buffer[9];
+	for (int plane = 0; plane < 6 && count >= 3; ++plane)
+	{
+		if (!(mask & (1 << plane)))
+			continue;
+
+		int n = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			const ClipVertex& a = polygon[i];
+			const ClipVertex& b = polygon[(i + 1) % count];
+			float da = PlaneDistance(a.position, plane), db = PlaneDistance(b.position, plane);
+
+			if (da >= 0)
+				buffer[n++] = a;
+			if ((da >= 0) != (db >= 0))
+			{
+				float t = da / (da - db);
+				ClipVertex& v = buffer[n++];
+				v.position = Vector4(a.position.x + (b.position.x - a.position.x) * t, a.position.y + (b.position.y - a.position.y) * t,
+					a.position.z + (b.position.z - a.position.z) * t, a.position.w + (b.position.w - a.position.w) * t);
+				v.color = a.color + (b.color - a.color) * t;
+			}
+		}
+
+		for (int i = 0; i < n; ++i)
+			polygon[i] = buffer[i];
+		count = n;
+	}
+	return count;
+}
+
+static inline Color ToColor(const Vector3& c)
+{
+	return Color(clamp(c.x + 0.5f, 0.0f, 255.0f), clamp(c.y + 0.5f, 0.0f, 255.0f), clamp(c.z + 0.5f, 0.0f, 255.0f));
+}
+
+// Perspective divide and viewport: x and y in pixels (y up, as the framebuffer) and z in [0, 1].
+// Same operations as Camera::ProjectVectors, so the vertices shared with unclipped triangles land on the same point
+static inline Vector3 ToScreen(const Vector4& v, float width, float height)
+{
+	return Vector3(v.x / v.w * (width * 0.5f) + width * 0.5f, v.y / v.w * (height * 0.5f) + height * 0.5f, v.z / v.w * 0.5f + 0.5f);
+}
+
+// Fills the triangles of a convex polygon as a fan
+static void DrawPolygon(Image* framebuffer, FloatImage* zbuffer, const ClipVertex* polygon, int count, bool backface_culling)
+{
+	const float width = (float)framebuffer->width, height = (float)framebuffer->height;
+	Vector3 p0 = ToScreen(polygon[0].position, width, height);
+	Color c0 = ToColor(polygon[0].color);
+	Vector3 p1 = ToScreen(polygon[1].position, width, height);
+	Color c1 = ToColor(polygon[1].color);
+
+	for (int i = 2; i < count; ++i)
+	{
+		Vector3 p2 = ToScreen(polygon[i].position, width, height);
+		Color c2 = ToColor(polygon[i].color);
+
+		float area = (p1.x - p0.x) * (p2.y - p0.y) - (p1.y - p0.y) * (p2.x - p0.x);
+		if (!backface_culling || area > 0)
+			framebuffer->DrawTriangleInterpolated(p0, p1, p2, c0, c1, c2, zbuffer);
+
+		p1 = p2;
+		c1 = c2;
+	}
+}
+
+Entity::Entity()
+{
+	mesh = NULL;
+	color = Color::WHITE;
+	backface_culling = true;
+}
+
+Entity::Entity(Mesh* mesh, const Color& color)
+{
+	this->mesh = mesh;
+	this->color = color;
+	backface_culling = true;
+}
+
+// True if the box is outside of one of the frustum planes (with the clip space of model_viewprojection)
+static bool IsBoxOutside(const Vector3& box_min, const Vector3& box_max, const Matrix44& model_viewprojection)
+{
+	int outside = 0x3F;		// Planes with all the corners outside
+	for (int i = 0; i < 8 && outside; ++i)
+	{
+		Vector4 corner(i & 1 ? box_max.x : box_min.x, i & 2 ? box_max.y : box_min.y, i & 4 ? box_max.z : box_min.z, 1.0f);
+		Vector4 clip = model_viewprojection * corner;
+		int flags = 0;
+		for (int plane = 0; plane < 6; ++plane)
+			if (PlaneDistance(clip, plane) < 0)
+				flags |= 1 << plane;
+		outside &= flags;
+	}
+	return outside != 0;
+}
+
+// Element i of an array with stride bytes between elements
+static inline const Vector3& StridedAt(const Vector3* base, size_t stride, size_t i)
+{
+	return *(const Vector3*)((const char*)base + i * stride);
+}
+
+void Entity::Render(Image* framebuffer, Camera* camera, FloatImage* zbuffer)
+{
+	RenderInstanced(framebuffer, camera, zbuffer, &model, 1);
+}
+
+void Entity::RenderInstanced(Image* framebuffer, Camera* camera, FloatImage* zbuffer, const Matrix44* models, int count)
+{
+	if (!mesh || count <= 0 || !framebuffer || framebuffer->width == 0 || framebuffer->height == 0)
+		return;
+
+	// Vertices to transform: the unique ones of an indexed mesh, or every triangle corner of a triangle list
+	const Vector3* positions = NULL;
+	const Vector3* normals = NULL;
+	size_t num_vertices, stride;
+	const unsigned int* indices = NULL;
+	if (mesh->IsIndexed())
+	{
+		const MeshVertex* unique = mesh->GetUniqueVertices();
+		num_vertices = mesh->GetNumUniqueVertices();
+		stride = sizeof(MeshVertex);
+		if (num_vertices)
+		{
+			positions = &unique[0].position;
+			normals = mesh->HasNormals() ? &unique[0].normal : NULL;
+		}
+		indices = mesh->GetIndices();
+	}
+	else
+	{
+		const std::vector<Vector3>& vertices = mesh->GetVertices();
+		num_vertices = vertices.size();
+		stride = sizeof(Vector3);
+		if (num_vertices)
+		{
+			positions = &vertices[0];
+			normals = mesh->GetNormals().size() >= num_vertices ? &mesh->GetNormals()[0] : NULL;
+		}
+	}
+	const size_t num_corners = mesh->GetNumTriangles() * 3;
+	if (num_vertices == 0 || num_corners == 0)
+		return;
+
+	// Shared by all the instances: Lambert lighting with a light at the camera (and some ambient)
+	Vector3 light = camera->eye - camera->center;
+	light.Normalize();
+	const Vector3 entity_color((float)color.r, (float)color.g, (float)color.b);
+	const float ambient = 0.25f;
+	const std::vector<SubMesh>& submeshes = mesh->GetSubMeshes();
+	const std::vector<MeshMaterial>& materials = mesh->GetMaterials();
+	const size_t num_ranges = indices && !submeshes.empty() ? submeshes.size() : 1;
+	ClipVertex polygon[9];
+
+	for (int instance = 0; instance < count; ++instance)
+	{
+		const Matrix44& model = models[instance];
+		if (IsBoxOutside(mesh->GetAABBMin(), mesh->GetAABBMax(), camera->viewprojection_matrix * model))
+			continue;
+
+		// Vertex stage (post-transform cache): every vertex is projected and lit once, and the triangles read them by index
+		camera->ProjectVectors(positions, num_vertices, stride, projected, &model, framebuffer->width, framebuffer->height);
+
+		Matrix44 normal_matrix = model;		// Only the rotation (the model is not expected to have non-uniform scale)
+		normal_matrix.m[12] = normal_matrix.m[13] = normal_matrix.m[14] = 0.0f;
+		if (normals)
+		{
+			vertex_light.resize(num_vertices);
+			for (size_t k = 0; k < num_vertices; ++k)
+			{
+				Vector3 n = normal_matrix * StridedAt(normals, stride, k);
+				n.Normalize();
+				vertex_light[k] = ambient + (1.0f - ambient) * std::max(0.0f, n.Dot(light));
+			}
+		}
+
+		// Primitive stage: trivial reject, clip the triangles crossing the frustum and rasterize.
+		// The triangles are drawn by material (one submesh each), whose diffuse color tints the color of the entity
+		const unsigned char* flags = &projected.clip_flags[0];
+		for (size_t r = 0; r < num_ranges; ++r)
+		{
+			size_t first = 0, end = num_corners;
+			Vector3 base = entity_color;
+			if (indices && !submeshes.empty())
+			{
+				first = submeshes[r].first_index;
+				end = first + submeshes[r].num_indices;
+				if (submeshes[r].material >= 0)
+					base = base * materials[submeshes[r].material].diffuse;
+			}
+
+			for (size_t t = first; t < end; t += 3)
+			{
+				size_t v[3] = { t, t + 1, t + 2 };
+				if (indices)
+				{
+					v[0] = indices[t]; v[1] = indices[t + 1]; v[2] = indices[t + 2];
+				}
+
+				int code0 = flags[v[0]], code1 = flags[v[1]], code2 = flags[v[2]];
+				if (code0 & code1 & code2)
+					continue;		// The three vertices are outside of the same plane
+
+				// Without normals the triangle is lit with its face normal
+				Vector3 colors[3];
+				if (normals)
+				{
+					colors[0] = base * vertex_light[v[0]]; colors[1] = base * vertex_light[v[1]]; colors[2] = base * vertex_light[v[2]];
+				}
+				else
+				{
+					Vector3 a = model * StridedAt(positions, stride, v[0]), b = model * StridedAt(positions, stride, v[1]), c = model * StridedAt(positions, stride, v[2]);
+					Vector3 n = (b - a).Cross(c - a);
+					n.Normalize();
+					colors[0] = colors[1] = colors[2] = base * (ambient + (1.0f - ambient) * std::max(0.0f, n.Dot(light)));
+				}
+
+				int crossed = code0 | code1 | code2;
+				if (!crossed)
+				{
+					// Inside the frustum: the projected vertices are used as they are
+					Vector3 p0(projected.x[v[0]], projected.y[v[0]], projected.z[v[0]]);
+					Vector3 p1(projected.x[v[1]], projected.y[v[1]], projected.z[v[1]]);
+					Vector3 p2(projected.x[v[2]], projected.y[v[2]], projected.z[v[2]]);
+					float area = (p1.x - p0.x) * (p2.y - p0.y) - (p1.y - p0.y) * (p2.x - p0.x);
+					if (!backface_culling || area > 0)
+						framebuffer->DrawTriangleInterpolated(p0, p1, p2, ToColor(colors[0]), ToColor(colors[1]), ToColor(colors[2]), zbuffer);
+					continue;
+				}
+
+				for (int k = 0; k < 3; ++k)
+				{
+					polygon[k].position = Vector4(projected.clip_x[v[k]], projected.clip_y[v[k]], projected.clip_z[v[k]], projected.clip_w[v[k]]);
+					polygon[k].color = colors[k];
+				}
+
+				int vertex_count = ClipPolygon(polygon, 3, crossed);
+				if (vertex_count >= 3)
+					DrawPolygon(framebuffer, zbuffer, polygon, vertex_count, backface_culling);
+			}
+		}
+	}
+}
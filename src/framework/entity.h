@@ -0,0 +1,43 @@
+/*
+	+ An Entity is a Mesh placed in the world with a model matrix, rendered on the CPU into an Image.
+	+ Render is a small software pipeline: all the vertices are projected at once with Camera::ProjectVectors,
+	  the triangles crossing the frustum are clipped against it, divided by w and mapped to the viewport, and
+	  all of them are filled with Image::DrawTriangleInterpolated, which depth tests them against a FloatImage z-buffer.
+	+ It does not need a GL context, so it also works headless on machines with no GPU.
+	+ RenderInstanced draws many copies of the entity (a crowd) with one model matrix each. What depends only on the mesh
+	  is prepared once, and the copies whose bounding box is outside of the frustum are skipped without projecting them.
+*/
+
+#pragma once
+
+#include <vector>
+#include "framework.h"
+#include "image.h"
+#include "mesh.h"
+#include "camera.h"
+
+class Entity
+{
+public:
+	Mesh* mesh;
+	Matrix44 model;
+	Color color;
+
+	// Triangles facing away from the camera are skipped (counter-clockwise is the front, as in OpenGL)
+	bool backface_culling;
+
+	Entity();
+	Entity(Mesh* mesh, const Color& color = Color::WHITE);
+
+	// The z-buffer must have the size of the framebuffer and be cleared to 1 (the far plane) every frame.
+	// Without it the triangles are drawn in order, with no depth test
+	void Render(Image* framebuffer, Camera* camera, FloatImage* zbuffer);
+
+	// Same as Render once per model matrix (the model of the entity is not used)
+	void RenderInstanced(Image* framebuffer, Camera* camera, FloatImage* zbuffer, const Matrix44* models, int count);
+
+private:
+	// Per vertex data reused between frames, so rendering does not allocate
+	ProjectedVertices projected;
+	std::vector<float> vertex_light;		// Lambert intensity
+};
@@ -49,9 +49,9 @@ float Vector2::Perpdot( const Vector2& v )
 
 void Vector2::Random(float range)
 {
-	//rand returns a value between 0 and RAND_MAX
-	x = (rand() / (float)RAND_MAX) * 2 * range - range; //value between -range and range
-	y = (rand() / (float)RAND_MAX) * 2 * range - range; //value between -range and range
+	::Random& random = ::Random::ThreadLocal();	//generator of this thread
+	x = random.NextFloat(-range, range); //value between -range and range
+	y = random.NextFloat(-range, range); //value between -range and range
 }
 
 
@@ -106,18 +106,18 @@ float Vector3::Dot( const Vector3& v ) const
 
 void Vector3::Random(float range)
 {
-	//rand returns a value between 0 and RAND_MAX
-	x = (rand() / (float)RAND_MAX) * 2 * range - range; //value between -range and range
-	y = (rand() / (float)RAND_MAX) * 2 * range - range; //value between -range and range
-	z = (rand() / (float)RAND_MAX) * 2 * range - range; //value between -range and range
+	::Random& random = ::Random::ThreadLocal();	//generator of this thread
+	x = random.NextFloat(-range, range); //value between -range and range
+	y = random.NextFloat(-range, range); //value between -range and range
+	z = random.NextFloat(-range, range); //value between -range and range
 }
 
 void Vector3::Random(Vector3 range)
 {
-	//rand returns a value between 0 and RAND_MAX
-	x = (rand() / (float)RAND_MAX) * 2 * range.x - range.x; //value between -range and range
-	y = (rand() / (float)RAND_MAX) * 2 * range.y - range.y; //value between -range and range
-	z = (rand() / (float)RAND_MAX) * 2 * range.z - range.z; //value between -range and range
+	::Random& random = ::Random::ThreadLocal();	//generator of this thread
+	x = random.NextFloat(-range.x, range.x); //value between -range and range
+	y = random.NextFloat(-range.y, range.y); //value between -range and range
+	z = random.NextFloat(-range.z, range.z); //value between -range and range
 }
 
 void Vector3::Clamp(float min, float max)
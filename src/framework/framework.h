@@ -7,6 +7,7 @@
 #include <vector>
 #include <cmath>
 #include <random>
+#include "random.h"
 
 #ifndef PI
 	#define PI 3.14159265359
@@ -36,7 +37,7 @@ public:
 	void operator = (const Vector3& v);
 
 	void Set(float r, float g, float b) { this->r = (unsigned char)clamp(r,0.0,255.0); this->g = (unsigned char)clamp(g,0.0,255.0); this->b = (unsigned char)clamp(b,0.0,255.0); }
-	void Random() { r = rand() % 255; g = rand() % 255; b = rand() % 255; }
+	void Random() { ::Random& random = ::Random::ThreadLocal(); r = random.NextInt(0, 254); g = random.NextInt(0, 254); b = random.NextInt(0, 254); }
 
 	Color operator * (float v) { return Color((unsigned char)(r*v), (unsigned char)(g*v), (unsigned char)(b*v)); }
 	void operator *= (float v) { r = (unsigned char)(r * v); g = (unsigned char)(g * v); b = (unsigned char)(b * v); }
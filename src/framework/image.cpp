@@ -8,18 +8,26 @@
 #include "utils.h"
 #include "camera.h"
 #include "mesh.h"
+#include "threadpool.h"
+#include "random.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define IMAGE_USE_SSE2
+#endif
 
 Image::Image() {
 	width = 0; height = 0;
 	pixels = NULL;
 }
 
-Image::Image(unsigned int width, unsigned int height)
+Image::Image(unsigned int width, unsigned int height, PixelFormat format)
 {
 	this->width = width;
 	this->height = height;
-	pixels = new Color[width*height];
-	memset(pixels, 0, width * height * sizeof(Color));
+	bytes_per_pixel = format == PIXEL_RGBA8 ? 4 : 3;
+	pixels = (Color*)AllocatePixels(width, height, bytes_per_pixel);
+	memset(pixels, 0, width * height * bytes_per_pixel);
 }
 
 // Copy constructor
@@ -31,7 +39,7 @@ Image::Image(const Image& c)
 	bytes_per_pixel = c.bytes_per_pixel;
 	if(c.pixels)
 	{
-		pixels = new Color[width*height];
+		pixels = (Color*)AllocatePixels(width, height, bytes_per_pixel);
 		memcpy(pixels, c.pixels, width*height*bytes_per_pixel);
 	}
 }
@@ -39,8 +47,8 @@ Image::Image(const Image& c)
 // Assign operator
 Image& Image::operator = (const Image& c)
 {
-	if(pixels) delete pixels;
-	pixels = NULL;
+	if (this == &c) return *this;
+	FreePixels();
 
 	width = c.width;
 	height = c.height;
@@ -48,7 +56,7 @@ Image& Image::operator = (const Image& c)
 
 	if(c.pixels)
 	{
-		pixels = new Color[width*height*bytes_per_pixel];
+		pixels = (Color*)AllocatePixels(width, height, bytes_per_pixel);
 		memcpy(pixels, c.pixels, width*height*bytes_per_pixel);
 	}
 	return *this;
@@ -56,57 +64,99 @@ Image& Image::operator = (const Image& c)
 
 Image::~Image()
 {
-	if(pixels) 
-		delete pixels;
+	FreePixels();
+}
+
+// The buffer is always allocated as uint32_t so the rows of PIXEL_RGBA8 images are aligned
+void* Image::AllocatePixels(unsigned int width, unsigned int height, unsigned int bytes_per_pixel)
+{
+	return new uint32_t[((size_t)width * height * bytes_per_pixel + 3) / 4];
+}
+
+void Image::FreePixels()
+{
+	delete[] pixels32;
+	pixels = NULL;
+}
+
+void Image::SetFormat(PixelFormat format)
+{
+	unsigned int new_bytes_per_pixel = format == PIXEL_RGBA8 ? 4 : 3;
+	if (new_bytes_per_pixel == bytes_per_pixel)
+		return;
+
+	void* new_pixels = AllocatePixels(width, height, new_bytes_per_pixel);
+	size_t count = (size_t)width * height;
+	if (pixels && format == PIXEL_RGBA8)
+		for (size_t i = 0; i < count; ++i)
+			((uint32_t*)new_pixels)[i] = PackColor(pixels[i]);
+	else if (pixels)
+		for (size_t i = 0; i < count; ++i)
+			((Color*)new_pixels)[i] = UnpackColor(pixels32[i]);
+
+	FreePixels();
+	bytes_per_pixel = new_bytes_per_pixel;
+	pixels = (Color*)new_pixels;
 }
 
 void Image::Render()
 {
-	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, bytes_per_pixel == 4 ? 4 : 1);
 	glDrawPixels(width, height, bytes_per_pixel == 3 ? GL_RGB : GL_RGBA, GL_UNSIGNED_BYTE, pixels);
 }
 
 // Change image size (the old one will remain in the top-left corner)
 void Image::Resize(unsigned int width, unsigned int height)
 {
-	Color* new_pixels = new Color[width*height];
+	void* new_pixels = AllocatePixels(width, height, bytes_per_pixel);
+	memset(new_pixels, 0, (size_t)width * height * bytes_per_pixel);
 	unsigned int min_width = this->width > width ? width : this->width;
 	unsigned int min_height = this->height > height ? height : this->height;
 
-	for(unsigned int x = 0; x < min_width; ++x)
-		for(unsigned int y = 0; y < min_height; ++y)
-			new_pixels[ y * width + x ] = GetPixel(x,y);
+	for(unsigned int y = 0; y < min_height; ++y)		// Copiamos filas enteras, sirve para los dos formatos
+		memcpy((unsigned char*)new_pixels + (size_t)y * width * bytes_per_pixel, (unsigned char*)pixels + (size_t)y * this->width * bytes_per_pixel, (size_t)min_width * bytes_per_pixel);
 
-	delete pixels;
+	FreePixels();
 	this->width = width;
 	this->height = height;
-	pixels = new_pixels;
+	pixels = (Color*)new_pixels;
+}
+
+// Copia escalada (vecino ms cercano) para cualquiera de los dos tipos de pxel
+template <typename T>
+static void ScalePixels(const T* src, unsigned int src_width, unsigned int src_height, T* dst, unsigned int width, unsigned int height)
+{
+	for(unsigned int x = 0; x < width; ++x)
+		for(unsigned int y = 0; y < height; ++y)
+			dst[ y * width + x ] = src[ (unsigned int)(src_height * (y / (float)height)) * src_width + (unsigned int)(src_width * (x / (float)width)) ];
 }
 
 // Change image size and scale the content
 void Image::Scale(unsigned int width, unsigned int height)
 {
-	Color* new_pixels = new Color[width*height];
+	void* new_pixels = AllocatePixels(width, height, bytes_per_pixel);
 
-	for(unsigned int x = 0; x < width; ++x)
-		for(unsigned int y = 0; y < height; ++y)
-			new_pixels[ y * width + x ] = GetPixel((unsigned int)(this->width * (x / (float)width)), (unsigned int)(this->height * (y / (float)height)) );
+	if (bytes_per_pixel == 4)
+		ScalePixels(pixels32, this->width, this->height, (uint32_t*)new_pixels, width, height);
+	else
+		ScalePixels(pixels, this->width, this->height, (Color*)new_pixels, width, height);
 
-	delete pixels;
+	FreePixels();
 	this->width = width;
 	this->height = height;
-	pixels = new_pixels;
+	pixels = (Color*)new_pixels;
 }
 
 Image Image::GetArea(unsigned int start_x, unsigned int start_y, unsigned int width, unsigned int height)
 {
-	Image result(width, height);
-	for(unsigned int x = 0; x < width; ++x)
-		for(unsigned int y = 0; y < height; ++y)
-		{
-			if( (x + start_x) < this->width && (y + start_y) < this->height) 
-				result.SetPixelUnsafe( x, y, GetPixel(x + start_x,y + start_y) );
-		}
+	Image result(width, height, GetFormat());
+	if (start_x >= this->width || start_y >= this->height)
+		return result;
+
+	unsigned int copy_width = std::min(width, this->width - start_x);
+	unsigned int copy_height = std::min(height, this->height - start_y);
+	for(unsigned int y = 0; y < copy_height; ++y)
+		memcpy((unsigned char*)result.pixels + (size_t)y * width * bytes_per_pixel, (unsigned char*)pixels + ((size_t)(y + start_y) * this->width + start_x) * bytes_per_pixel, (size_t)copy_width * bytes_per_pixel);
 	return result;
 }
 
@@ -157,24 +207,19 @@ bool Image::LoadPNG(const char* filename, bool flip_y)
 
 	size_t bufferSize = out_image.size();
 	unsigned int originalBytesPerPixel = (unsigned int)bufferSize / (width * height);
-	
-	// Force 3 channels
-	bytes_per_pixel = 3;
 
-	if (originalBytesPerPixel == 3) {
-		pixels = new Color[bufferSize];
+	// picopng devuelve RGBA de 8 bits, que es justo el formato PIXEL_RGBA8: nos quedamos con el alfa
+	FreePixels();
+
+	if (originalBytesPerPixel == 4) {
+		bytes_per_pixel = 4;
+		pixels = (Color*)AllocatePixels(width, height, bytes_per_pixel);
 		memcpy(pixels, &out_image[0], bufferSize);
 	}
-	else if (originalBytesPerPixel == 4) {
-
-		unsigned int newBufferSize = width * height * bytes_per_pixel;
-		pixels = new Color[newBufferSize];
-
-		unsigned int k = 0;
-		for (unsigned int i = 0; i < bufferSize; i += originalBytesPerPixel) {
-			pixels[k] = Color(out_image[i], out_image[i + 1], out_image[i + 2]);
-			k++;
-		}
+	else {
+		bytes_per_pixel = 3;
+		pixels = (Color*)AllocatePixels(width, height, bytes_per_pixel);
+		memcpy(pixels, &out_image[0], std::min(bufferSize, (size_t)width * height * 3));
 	}
 
 	// Flip pixels in Y
@@ -240,21 +285,26 @@ bool Image::LoadTGA(const char* filename, bool flip_y)
 
 	fclose(file);
 
-	// Save info in image
-	if(pixels)
-		delete pixels;
+	// Save info in image (32 bit files keep their alpha in a PIXEL_RGBA8 image)
+	FreePixels();
 
 	width = tgainfo->width;
 	height = tgainfo->height;
-	pixels = new Color[width*height];
+	bytes_per_pixel = bytesPerPixel == 4 ? 4 : 3;
+	pixels = (Color*)AllocatePixels(width, height, bytes_per_pixel);
 
 	// Convert to float all pixels
 	for (unsigned int y = 0; y < height; ++y) {
 		for (unsigned int x = 0; x < width; ++x) {
 			unsigned int pos = y * width * bytesPerPixel + x * bytesPerPixel;
 			// Make sure we don't access out of memory
-			if( (pos < imageSize) && (pos + 1 < imageSize) && (pos + 2 < imageSize))
-				SetPixelUnsafe(x, height - y - 1, Color(tgainfo->data[pos + 2], tgainfo->data[pos + 1], tgainfo->data[pos]));
+			if( (pos < imageSize) && (pos + 1 < imageSize) && (pos + 2 < imageSize)) {
+				Color c(tgainfo->data[pos + 2], tgainfo->data[pos + 1], tgainfo->data[pos]);
+				if (bytes_per_pixel == 4)
+					pixels32[(height - y - 1) * width + x] = PackColor(c, tgainfo->data[pos + 3]);
+				else
+					SetPixelUnsafe(x, height - y - 1, c);
+			}
 		}
 	}
 
@@ -269,11 +319,11 @@ bool Image::LoadTGA(const char* filename, bool flip_y)
 }
 
 // Saves the image to a TGA file
-bool Image::SaveTGA(const char* filename)
+bool Image::SaveTGA(const char* filename, bool res_path)
 {
 	unsigned char TGAheader[12] = {0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
-	std::string fullPath = absResPath(filename);
+	std::string fullPath = res_path ? absResPath(filename) : std::string(filename);
 	FILE *file = fopen(fullPath.c_str(), "wb");
 	if ( file == NULL )
 	{
@@ -296,7 +346,7 @@ bool Image::SaveTGA(const char* filename)
 	for(unsigned int y = 0; y < height; ++y)
 		for(unsigned int x = 0; x < width; ++x)
 		{
-			Color c = pixels[y*width+x];
+			Color c = GetPixel(x, y);
 			unsigned int pos = (y*width+x)*3;
 			bytes[pos+2] = c.r;
 			bytes[pos+1] = c.g;
@@ -306,102 +356,794 @@ bool Image::SaveTGA(const char* filename)
 	fwrite(bytes, 1, width*height*3, file);
 	fclose(file);
 
+	delete[] bytes;
+
 	return true;
 }
 
 
 // DECLARACIN FUNCIN DRAWPIXEL PARA POSTEIORMENTE USARLO PARA LA CREACIN DE PARTCULAS
 void Image::DrawPixel(int x, int y, const Color& color) {
-	if (x >= 0 && x < width && y >= 0 && y < height) {
-		pixels[y * width + x] = color;
+	int cx0, cy0, cx1, cy1;
+	GetClipBounds(cx0, cy0, cx1, cy1);
+	if (x >= cx0 && x <= cx1 && y >= cy0 && y <= cy1) {
+		SetPixelUnsafe(x, y, color);
+		if (track_dirty) MarkDirty(x, y, x, y);
 	}
 }
 
-// FUNCIONES PARA INICIALIZAR, RENDERIZAR Y ACTUALIZAR LAS PARTCULAS POR PANTALLA
-void ParticleSystem::Init() {
-	srand(static_cast<unsigned>(time(0))); // Inicializamos la generacin de nmeros aleatorios
-	for (int i = 0; i < MAX_PARTICLES; ++i) { // Creamos un loop con todas las partculas
-		particles[i].position = { static_cast<float>(rand() % 2560), static_cast<float>(rand() % 1369) }; // Asignamos una posicin aleatoria a la partcula en un margen de 2560x1369
-		particles[i].velocity = { 0.0f, static_cast<float>(-(rand() % 5 + 1) * 10) }; // Asignamos una velocidad aleatoria a la partcula
-		int colorChoice = rand() % 3; // Elegimos un color aleatorio entre tres opciones
-		if (colorChoice == 0) {
-			particles[i].color = Color(255, 255, 255); // Blanco
+// RECTNGULO DE RECORTE DE LAS FUNCIONES DE DIBUJO
+void Image::SetClipRect(int x, int y, int w, int h) {
+	clip_enabled = true;
+	clip_x = x;
+	clip_y = y;
+	clip_w = w;
+	clip_h = h;
+}
+
+void Image::ResetClipRect() {
+	clip_enabled = false;
+}
+
+// Devuelve los lmites (incluidos) donde se puede dibujar: el rectngulo de recorte dentro de la imagen
+void Image::GetClipBounds(int& x0, int& y0, int& x1, int& y1) const {
+	x0 = 0;
+	y0 = 0;
+	x1 = (int)width - 1;
+	y1 = (int)height - 1;
+	if (clip_enabled) {
+		x0 = std::max(x0, clip_x);
+		y0 = std::max(y0, clip_y);
+		x1 = std::min(x1, clip_x + clip_w - 1);
+		y1 = std::min(y1, clip_y + clip_h - 1);
+	}
+}
+
+// REGIONES MODIFICADAS: se juntan los rectngulos que se tocan y nunca hay ms de MAX_DIRTY_RECTS
+void Image::MarkDirty(int x0, int y0, int x1, int y1)
+{
+	if (!track_dirty) return;
+
+	int cx0, cy0, cx1, cy1;		// Solo se puede haber dibujado dentro del recorte
+	GetClipBounds(cx0, cy0, cx1, cy1);
+	x0 = std::max(x0, cx0); y0 = std::max(y0, cy0);
+	x1 = std::min(x1, cx1); y1 = std::min(y1, cy1);
+	if (x0 > x1 || y0 > y1) return;
+
+	// Lo ms habitual es que ya est dentro del ltimo rectngulo (las filas de un mismo relleno)
+	for (int i = (int)dirty_rects.size() - 1; i >= 0; --i) {
+		const DirtyRect& r = dirty_rects[i];
+		if (x0 >= r.x0 && x1 <= r.x1 && y0 >= r.y0 && y1 <= r.y1)
+			return;
+	}
+
+	// Si se solapa o toca con alguno se unen; si no, se aade. Cuando ya hay demasiados se une con el que menos crece
+	int best = -1;
+	long long best_growth = LLONG_MAX;
+	for (int i = 0; i < (int)dirty_rects.size(); ++i) {
+		const DirtyRect& r = dirty_rects[i];
+		if (x0 <= r.x1 + 1 && x1 + 1 >= r.x0 && y0 <= r.y1 + 1 && y1 + 1 >= r.y0) {
+			best = i;
+			break;
 		}
-		else if (colorChoice == 1) {
-			particles[i].color = Color(0, 14, 255); // Azul
+		if ((int)dirty_rects.size() >= MAX_DIRTY_RECTS) {
+			long long area = (long long)(r.x1 - r.x0 + 1) * (r.y1 - r.y0 + 1);
+			long long merged = (long long)(std::max(x1, r.x1) - std::min(x0, r.x0) + 1) * (std::max(y1, r.y1) - std::min(y0, r.y0) + 1);
+			if (merged - area < best_growth) {
+				best_growth = merged - area;
+				best = i;
+			}
 		}
-		else {
-			particles[i].color = Color(132, 0, 255); // Morado
+	}
+
+	if (best < 0) {
+		DirtyRect r = { x0, y0, x1, y1 };
+		dirty_rects.push_back(r);
+		return;
+	}
+
+	DirtyRect& r = dirty_rects[best];
+	r.x0 = std::min(r.x0, x0); r.y0 = std::min(r.y0, y0);
+	r.x1 = std::max(r.x1, x1); r.y1 = std::max(r.y1, y1);
+}
+
+// Unin de todas las regiones modificadas, false si no hay ninguna
+bool Image::GetDirtyBounds(int& x0, int& y0, int& x1, int& y1) const
+{
+	if (dirty_rects.empty()) return false;
+	x0 = y0 = INT_MAX;
+	x1 = y1 = INT_MIN;
+	for (size_t i = 0; i < dirty_rects.size(); ++i) {
+		x0 = std::min(x0, dirty_rects[i].x0); y0 = std::min(y0, dirty_rects[i].y0);
+		x1 = std::max(x1, dirty_rects[i].x1); y1 = std::max(y1, dirty_rects[i].y1);
+	}
+	return true;
+}
+
+// Mezcla src sobre dst con el alfa a (0..255), redondeando igual que (src*a + dst*(255-a)) / 255
+static inline unsigned char BlendChannel(unsigned char src, unsigned char dst, unsigned int a)
+{
+	unsigned int v = src * a + dst * (255 - a) + 128;
+	return (unsigned char)((v + (v >> 8)) >> 8);
+}
+
+// FUNCIN PARA COPIAR UNA IMAGEN (RECORTADA) EN (x, y). LAS FILAS OPACAS DEL MISMO FORMATO SE COPIAN CON memcpy
+void Image::DrawImage(const Image& image, int x, int y)
+{
+	int cx0, cy0, cx1, cy1;
+	GetClipBounds(cx0, cy0, cx1, cy1);
+	int x0 = std::max(x, cx0), x1 = std::min(x + (int)image.width - 1, cx1);
+	int y0 = std::max(y, cy0), y1 = std::min(y + (int)image.height - 1, cy1);
+	if (x0 > x1 || y0 > y1) return;
+	if (track_dirty) MarkDirty(x0, y0, x1, y1);
+
+	const int count = x1 - x0 + 1;
+	for (int py = y0; py <= y1; ++py)
+	{
+		const unsigned int sy = py - y, sx = x0 - x;
+
+		if (image.bytes_per_pixel == 3)		// Sin alfa: copia directa
+		{
+			const Color* src = image.pixels + (size_t)sy * image.width + sx;
+			if (bytes_per_pixel == 3)
+				memcpy(pixels + (size_t)py * width + x0, src, count * sizeof(Color));
+			else
+				for (int i = 0; i < count; ++i)
+					pixels32[(size_t)py * width + x0 + i] = PackColor(src[i]);
+			continue;
+		}
+
+		const uint32_t* src = image.pixels32 + (size_t)sy * image.width + sx;
+		for (int i = 0; i < count; ++i)
+		{
+			unsigned int a = UnpackAlpha(src[i]);
+			if (a == 0) continue;		// Transparente: no se toca el destino
+			if (a == 255) {
+				if (bytes_per_pixel == 4) pixels32[(size_t)py * width + x0 + i] = src[i];
+				else pixels[(size_t)py * width + x0 + i] = UnpackColor(src[i]);
+				continue;
+			}
+
+			Color s = UnpackColor(src[i]);
+			Color d = GetPixel(x0 + i, py);
+			Color c;
+			c.r = BlendChannel(s.r, d.r, a);
+			c.g = BlendChannel(s.g, d.g, a);
+			c.b = BlendChannel(s.b, d.b, a);
+			SetPixelUnsafe(x0 + i, py, c);		// El alfa del destino se mantiene opaco
 		}
-		particles[i].acceleration = 0.0f; // Ponemos la aceleracin de la partcula a 0
-		particles[i].ttl = static_cast<float>(rand() % 100 + 50); // Asignamos un tiempo de vida aleatorio a la partcula
-		particles[i].inactive = false; // Marcamos la partcula como activa
-		particles[i].size = static_cast<float>(rand() % 3 + 1); // Asignamos un tamao aleatorio a la partcula entre 1 y 3 (para dar variedad a la imagen)
+	}
+}
+
+// FUNCIONES PARA INICIALIZAR, RENDERIZAR Y ACTUALIZAR LAS PARTCULAS POR PANTALLA
+static const Color particle_colors[3] = { Color(255, 255, 255), Color(0, 14, 255), Color(132, 0, 255) };		// Blanco, azul y morado
+
+ParticlePool::ParticlePool(int max_free)
+{
+	this->max_free = max_free;
+	free_list = NULL;
+	num_free = 0;
+	num_allocated = 0;
+}
+
+ParticlePool::~ParticlePool()
+{
+	Trim();
+}
+
+ParticlePool* ParticlePool::Get()
+{
+	static ParticlePool pool;
+	return &pool;
+}
+
+ParticleChunk* ParticlePool::Allocate()
+{
+	if (!free_list) {
+		num_allocated++;
+		return new ParticleChunk;
+	}
+	ParticleChunk* chunk = free_list;
+	free_list = chunk->next;
+	num_free--;
+	return chunk;
+}
+
+void ParticlePool::Release(ParticleChunk* chunk)
+{
+	if (num_free >= max_free) {		// Ya hay bastantes libres, se devuelve la memoria
+		delete chunk;
+		num_allocated--;
+		return;
+	}
+	chunk->next = free_list;
+	free_list = chunk;
+	num_free++;
+}
+
+void ParticlePool::Trim()
+{
+	while (free_list) {
+		ParticleChunk* next = free_list->next;
+		delete free_list;
+		free_list = next;
+		num_allocated--;
+	}
+	num_free = 0;
+}
+
+ParticleSystem::ParticleSystem(ParticlePool* pool, ThreadPool* thread_pool)
+{
+	// El pool compartido se crea aqu, as se destruye despus que los emisores globales
+	this->pool = pool ? pool : ParticlePool::Get();
+	this->thread_pool = thread_pool;
+	num_active = 0;
+	spawn_accumulator = 0.0f;
+	seed = 0;
+	spawn_counter = 0;
+}
+
+ParticleSystem::~ParticleSystem()
+{
+	Clear();
+}
+
+// Los hilos se piden la primera vez que se usan, no al construir los emisores globales
+ThreadPool* ParticleSystem::GetThreadPool() const
+{
+	return thread_pool ? thread_pool : ThreadPool::Get();
+}
+
+// Crea las partculas [i0, i1) del bloque con un generador propio: cada atributo se genera de golpe con SIMD y sin ningn salto.
+// El generador solo depende de la semilla y de stream, as que el resultado es el mismo se creen en el hilo que se creen
+void ParticleSystem::Spawn(ParticleChunk* chunk, int i0, int i1, uint64_t stream) const {
+	Random random(seed, stream);
+	const int count = i1 - i0;
+
+	random.FillFloat(chunk->x + i0, count, (float)params.bounds_x, (float)(params.bounds_x + params.bounds_width));		// Posicin aleatoria dentro de la zona de emisin
+	random.FillFloat(chunk->y + i0, count, (float)params.bounds_y, (float)(params.bounds_y + params.bounds_height));
+	random.FillFloat(chunk->vx + i0, count, params.vx_min, params.vx_max);
+	random.FillFloat(chunk->vy + i0, count, params.vy_min, params.vy_max);
+	random.FillFloat(chunk->ttl + i0, count, params.ttl_min, params.ttl_max);
+
+	int values[ParticleChunk::SIZE];
+	random.FillInt(values, count, params.size_min, params.size_max);		// Tamaos distintos para dar variedad a la imagen
+	for (int i = 0; i < count; ++i)
+		chunk->size[i0 + i] = (float)values[i];
+	random.FillInt(values, count, 0, 2);		// Uno de los tres colores
+	for (int i = 0; i < count; ++i)
+		chunk->color[i0 + i] = (unsigned char)values[i];
+}
+
+void ParticleSystem::Init(int width, int height) {
+	Init(ParticleEmitterParams(), width, height);
+}
+
+void ParticleSystem::Init(const ParticleEmitterParams& params, int width, int height) {
+	Clear();
+	this->params = params;
+	this->params.capacity = std::max(params.capacity, 0);
+	this->params.size_max = std::max(params.size_max, params.size_min);
+	if (params.bounds_width <= 0 || params.bounds_height <= 0) {		// Por defecto las partculas ocupan todo el framebuffer
+		this->params.bounds_x = this->params.bounds_y = 0;
+		this->params.bounds_width = width;
+		this->params.bounds_height = height;
+	}
+
+	seed = params.seed ? params.seed : static_cast<uint64_t>(time(0));	// Sin semilla cada ejecucin genera una secuencia distinta
+	spawn_counter = 0;
+	spawn_accumulator = 0.0f;
+	if (this->params.refill)
+		Emit(this->params.capacity);		// El emisor empieza lleno
+}
+
+int ParticleSystem::Emit(int count) {
+	const int S = ParticleChunk::SIZE;
+	count = std::min(count, params.capacity - num_active);
+	if (count <= 0)
+		return 0;
+
+	const int start = num_active;
+	const int end = num_active + count;
+	while ((int)chunks.size() * S < end)		// Se piden al pool solo los bloques que hacen falta
+		chunks.push_back(pool->Allocate());
+
+	// Cada bloque se rellena en un hilo. Su generador usa como stream el nmero de la primera partcula que crea,
+	// as que el resultado es el mismo con cualquier nmero de hilos
+	const int first_chunk = start / S;
+	GetThreadPool()->ParallelFor((end - 1) / S - first_chunk + 1, [&](int index, int thread_index) {
+		const int c = first_chunk + index;
+		const int j0 = std::max(start, c * S), j1 = std::min(end, (c + 1) * S);
+		Spawn(chunks[c], j0 - c * S, j1 - c * S, spawn_counter + (uint64_t)(j0 - start));
+	});
+
+	spawn_counter += (uint64_t)count;
+	num_active = end;
+	return count;
+}
+
+void ParticleSystem::Clear() {
+	for (size_t c = 0; c < chunks.size(); ++c)
+		pool->Release(chunks[c]);
+	chunks.clear();
+	num_active = 0;
+}
+
+// Copia count partculas seguidas de un bloque a otro
+static void CopyParticles(ParticleChunk* dst, int dst_i, const ParticleChunk* src, int src_i, int count) {
+	memcpy(dst->x + dst_i, src->x + src_i, count * sizeof(float));
+	memcpy(dst->y + dst_i, src->y + src_i, count * sizeof(float));
+	memcpy(dst->vx + dst_i, src->vx + src_i, count * sizeof(float));
+	memcpy(dst->vy + dst_i, src->vy + src_i, count * sizeof(float));
+	memcpy(dst->ttl + dst_i, src->ttl + src_i, count * sizeof(float));
+	memcpy(dst->size + dst_i, src->size + src_i, count * sizeof(float));
+	memcpy(dst->color + dst_i, src->color + src_i, count);
+}
+
+// Cuadrado de la partcula i recortado a [cx0, cx1] x [cy0, cy1], devuelve false si queda fuera.
+// Cubre los mismos pxeles que DrawPixel((int)(x + dx), (int)(y + dy)) con dx, dy en [-size, size]
+static inline bool ParticleRectClipped(const ParticleChunk* k, int i, int cx0, int cy0, int cx1, int cy1, int& x0, int& y0, int& x1, int& y1) {
+	const float s = k->size[i];
+	x0 = std::max((int)(k->x[i] - s), cx0); x1 = std::min((int)(k->x[i] + s), cx1);
+	y0 = std::max((int)(k->y[i] - s), cy0); y1 = std::min((int)(k->y[i] + s), cy1);
+	return x0 <= x1 && y0 <= y1;
+}
+
+// Pinta el cuadrado [x0, x1] x [y0, y1] de una partcula fila a fila
+static inline void DrawParticleRect(Image& framebuffer, int x0, int y0, int x1, int y1, const Color& c) {
+	const size_t W = framebuffer.width;
+	if (framebuffer.bytes_per_pixel == 4) {
+		const uint32_t packed = Image::PackColor(c);
+		for (int y = y0; y <= y1; ++y)
+			std::fill(framebuffer.pixels32 + y * W + x0, framebuffer.pixels32 + y * W + x1 + 1, packed);
+	}
+	else {
+		for (int y = y0; y <= y1; ++y)
+			std::fill(framebuffer.pixels + y * W + x0, framebuffer.pixels + y * W + x1 + 1, c);
 	}
 }
 
 void ParticleSystem::Render(Image* framebuffer) {
-	for (int i = 0; i < MAX_PARTICLES; ++i) { // Volvemos a usar el loop para todas las partculas
-		if (!particles[i].inactive) { // Si la partcula est activa...
-			for (int dx = -particles[i].size; dx <= particles[i].size; ++dx) { // Iteramos sobre el tamao de la partcula en el eje x
-				for (int dy = -particles[i].size; dy <= particles[i].size; ++dy) { // Iteramos sobre el tamao de la partcula en el eje y
-					framebuffer->DrawPixel(static_cast<int>(particles[i].position.x + dx), static_cast<int>(particles[i].position.y + dy), particles[i].color); // Aqu dibujamos el pxel de la partcula en el framebuffer
-				}
+	const int S = ParticleChunk::SIZE;
+	int cx0, cy0, cx1, cy1;
+	framebuffer->GetClipBounds(cx0, cy0, cx1, cy1);
+	if (num_active == 0 || cx0 > cx1 || cy0 > cy1)
+		return;
+
+	// Las partculas estn dentro de la zona de emisin (ms su tamao), se marca una vez en vez de pxel a pxel
+	const int margin = params.size_max;
+	framebuffer->MarkDirty(params.bounds_x - margin, params.bounds_y - margin,
+		params.bounds_x + params.bounds_width + margin, params.bounds_y + params.bounds_height + margin);
+
+	ThreadPool* threads = GetThreadPool();
+	const int num_chunks = (num_active + S - 1) / S;
+	const int num_threads = threads->GetNumThreads();
+
+	// Con un solo hilo (o un framebuffer enorme que no cabe en los rectngulos de 16 bits) se pintan directamente en orden
+	if (num_threads == 1 || num_chunks == 1 || framebuffer->width > 65535 || framebuffer->height > 65535) {
+		for (int c = 0; c < num_chunks; ++c) {
+			const ParticleChunk* k = chunks[c];
+			const int count = std::min(S, num_active - c * S);
+			for (int i = 0; i < count; ++i) {
+				int x0, y0, x1, y1;
+				if (ParticleRectClipped(k, i, cx0, cy0, cx1, cy1, x0, y0, x1, y1))
+					DrawParticleRect(*framebuffer, x0, y0, x1, y1, particle_colors[k->color[i]]);
+			}
+		}
+		return;
+	}
+
+	// Varias franjas por hilo para repartir mejor la carga, cada grupo de bloques lo clasifica un hilo
+	const int num_strips = std::min(num_threads * 4, cy1 - cy0 + 1);
+	const int strip_height = (cy1 - cy0 + num_strips) / num_strips;
+	const int num_groups = std::min(num_threads, num_chunks);
+
+	// 1. Cada grupo cuenta sus partculas en cada franja (una partcula puede tocar dos franjas)
+	strip_offsets.assign(num_groups * num_strips, 0);
+	threads->ParallelFor(num_groups, [&](int g, int thread_index) {
+		int* counts = &strip_offsets[g * num_strips];
+		for (int c = g * num_chunks / num_groups; c < (g + 1) * num_chunks / num_groups; ++c) {
+			const ParticleChunk* k = chunks[c];
+			const int count = std::min(S, num_active - c * S);
+			for (int i = 0; i < count; ++i) {
+				int x0, y0, x1, y1;
+				if (!ParticleRectClipped(k, i, cx0, cy0, cx1, cy1, x0, y0, x1, y1))
+					continue;
+				for (int t = (y0 - cy0) / strip_height; t <= (y1 - cy0) / strip_height; ++t)
+					counts[t]++;
 			}
 		}
+	});
+
+	// 2. Posiciones: las franjas seguidas y dentro de cada franja los grupos en orden, as se pintan en el mismo orden que con un hilo
+	strip_begin.resize(num_strips + 1);
+	int total = 0;
+	for (int t = 0; t < num_strips; ++t) {
+		strip_begin[t] = total;
+		for (int g = 0; g < num_groups; ++g) {
+			int count = strip_offsets[g * num_strips + t];
+			strip_offsets[g * num_strips + t] = total;
+			total += count;
+		}
 	}
+	strip_begin[num_strips] = total;
+	strip_particles.resize(total);
+
+	// 3. Cada grupo escribe los cuadrados de sus partculas en las franjas, as al pintar se leen seguidos
+	threads->ParallelFor(num_groups, [&](int g, int thread_index) {
+		int* offsets = &strip_offsets[g * num_strips];
+		for (int c = g * num_chunks / num_groups; c < (g + 1) * num_chunks / num_groups; ++c) {
+			const ParticleChunk* k = chunks[c];
+			const int count = std::min(S, num_active - c * S);
+			for (int i = 0; i < count; ++i) {
+				int x0, y0, x1, y1;
+				if (!ParticleRectClipped(k, i, cx0, cy0, cx1, cy1, x0, y0, x1, y1))
+					continue;
+				ParticleRect rect = { (uint16_t)x0, (uint16_t)x1, (uint16_t)y0, (uint16_t)y1, k->color[i] };
+				for (int t = (y0 - cy0) / strip_height; t <= (y1 - cy0) / strip_height; ++t)
+					strip_particles[offsets[t]++] = rect;
+			}
+		}
+	});
+
+	// 4. Cada franja la pinta un hilo, recortando los cuadrados a sus filas: nunca hay dos hilos escribiendo en la misma fila
+	threads->ParallelFor(num_strips, [&](int t, int thread_index) {
+		const int y0 = cy0 + t * strip_height;
+		const int y1 = std::min(y0 + strip_height - 1, cy1);
+		for (int p = strip_begin[t]; p < strip_begin[t + 1]; ++p) {
+			const ParticleRect& r = strip_particles[p];
+			DrawParticleRect(*framebuffer, r.x0, std::max((int)r.y0, y0), r.x1, std::min((int)r.y1, y1), particle_colors[r.color]);
+		}
+	});
 }
 
 void ParticleSystem::Update(float dt) {
-	for (int i = 0; i < MAX_PARTICLES; ++i) { // De nuevo el mismo loop que las dos funciones anteriores
-		if (!particles[i].inactive) { // Si la partcula est activa...
-			particles[i].position.x += particles[i].velocity.x * dt; // Actualizamos la posicin de la partcula en el eje x
-			particles[i].position.y += particles[i].velocity.y * dt; // Actualizamos la posicin de la partcula en el eje y
-			particles[i].ttl -= dt; // Reducimos el tiempo de vida de la partcula
-			if (particles[i].ttl <= 0 || particles[i].position.y < 0) { // Si el tiempo de vida de la partcula ha expirado o la partcula ha salido de la pantalla...
-				particles[i].inactive = true; // Marcamos la partcula como inactiva
-				// Reiniciamos la partcula
-				particles[i].position = { static_cast<float>(rand() % 2560), static_cast<float>(rand() % 1369) }; // Generamos una nueva posicin para la partcula desde la parte superior
-				particles[i].velocity = { 0.0f, static_cast<float>(-(rand() % 5 + 1) * 10) }; // Asignamos una nueva velocidad a la partcula
-				int colorChoice = rand() % 3; // Elegimos un nuevo color aleatorio para la partcula
-				if (colorChoice == 0) {
-					particles[i].color = Color(255, 255, 255); // Blanco
-				}
-				else if (colorChoice == 1) {
-					particles[i].color = Color(0, 14, 255); // Azul
-				}
-				else {
-					particles[i].color = Color(132, 0, 255); // Morado
+	const int S = ParticleChunk::SIZE;
+	const int n = num_active;
+	const int num_chunks = (n + S - 1) / S;
+	ThreadPool* threads = GetThreadPool();
+
+	const float x0 = (float)params.bounds_x, x1 = (float)(params.bounds_x + params.bounds_width);
+	const float y0 = (float)params.bounds_y, y1 = (float)(params.bounds_y + params.bounds_height);
+
+	// 1. Cada bloque en un hilo: movemos y envejecemos sus partculas y compactamos las vivas al principio del bloque.
+	// Cada partcula que ha expirado (ttl <= 0) o ha salido de la zona de emisin se sustituye por la ltima del bloque
+	chunk_live.resize(num_chunks);
+	threads->ParallelFor(num_chunks, [&](int c, int thread_index) {
+		ParticleChunk* k = chunks[c];
+		int count = std::min(S, n - c * S);
+		int i = 0;
+#ifdef IMAGE_USE_SSE2
+		const __m128 vdt = _mm_set1_ps(dt);
+		for (; i + 4 <= count; i += 4) {		// 4 partculas a la vez (los arrays estn alineados)
+			_mm_store_ps(k->x + i, _mm_add_ps(_mm_load_ps(k->x + i), _mm_mul_ps(_mm_load_ps(k->vx + i), vdt)));
+			_mm_store_ps(k->y + i, _mm_add_ps(_mm_load_ps(k->y + i), _mm_mul_ps(_mm_load_ps(k->vy + i), vdt)));
+			_mm_store_ps(k->ttl + i, _mm_sub_ps(_mm_load_ps(k->ttl + i), vdt));
+		}
+#endif
+		for (; i < count; ++i) {
+			k->x[i] += k->vx[i] * dt;
+			k->y[i] += k->vy[i] * dt;
+			k->ttl[i] -= dt;
+		}
+
+#ifdef IMAGE_USE_SSE2
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 vx0 = _mm_set1_ps(x0), vx1 = _mm_set1_ps(x1);
+		const __m128 vy0 = _mm_set1_ps(y0), vy1 = _mm_set1_ps(y1);
+#endif
+		i = 0;
+		while (i < count) {
+#ifdef IMAGE_USE_SSE2
+			if ((i & 3) == 0 && i + 4 <= count) {		// Saltamos de 4 en 4 los grupos en los que estn todas vivas
+				__m128 px = _mm_load_ps(k->x + i), py = _mm_load_ps(k->y + i);
+				__m128 live = _mm_and_ps(_mm_cmpgt_ps(_mm_load_ps(k->ttl + i), zero),
+					_mm_and_ps(_mm_and_ps(_mm_cmpge_ps(px, vx0), _mm_cmplt_ps(px, vx1)), _mm_and_ps(_mm_cmpge_ps(py, vy0), _mm_cmplt_ps(py, vy1))));
+				if (_mm_movemask_ps(live) == 0xF) {
+					i += 4;
+					continue;
 				}
-				particles[i].ttl = static_cast<float>(rand() % 100 + 50); // Asignamos un nuevo tiempo de vida a la partcula
-				particles[i].inactive = false; // Marcamos la partcula como activa
-				particles[i].size = static_cast<float>(rand() % 3 + 1); // Asignamos un nuevo tamao a la partcula entre 1 y 3
 			}
+#endif
+			const float px = k->x[i], py = k->y[i];
+			if ((k->ttl[i] > 0.0f) & (px >= x0) & (px < x1) & (py >= y0) & (py < y1)) {
+				++i;
+				continue;
+			}
+			--count;		// La ltima pasa al hueco y se vuelve a comprobar en la siguiente vuelta
+			if (i < count)
+				CopyParticles(k, i, k, count, 1);
 		}
+		chunk_live[c] = count;
+	});
+
+	// 2. Rellenamos los huecos de los primeros bloques con las partculas de los ltimos (copias de trozos seguidos)
+	int front = 0, back = num_chunks - 1;
+	while (true) {
+		while (front < back && chunk_live[front] == S) front++;
+		while (back > front && chunk_live[back] == 0) back--;
+		if (front >= back)
+			break;
+		const int count = std::min(S - chunk_live[front], chunk_live[back]);
+		CopyParticles(chunks[front], chunk_live[front], chunks[back], chunk_live[back] - count, count);
+		chunk_live[front] += count;
+		chunk_live[back] -= count;
+	}
+	num_active = 0;
+	for (int c = 0; c < num_chunks; ++c)
+		num_active += chunk_live[c];
+
+	// Los bloques que se han quedado vacos vuelven al pool
+	while ((int)chunks.size() > (num_active + S - 1) / S) {
+		pool->Release(chunks.back());
+		chunks.pop_back();
 	}
+
+	// 3. Partculas nuevas: las que sustituyen a las que han expirado y las de spawn_rate
+	spawn_accumulator += params.spawn_rate * dt;
+	int count = (int)spawn_accumulator;
+	spawn_accumulator -= (float)count;
+	if (params.refill)
+		count = params.capacity;
+	Emit(count);
 }
 
 
-// FUNCIN PARA DIBUJAR LNEAS CON EL MTODO DDA
-void Image::DrawLineDDA(int x0, int y0, int x1, int y1, const Color& c) {
+// PATRN DE BYTES DE UN COLOR PARA RELLENAR CON ESCRITURAS ANCHAS
+// 48 bytes son 16 pxeles de 3 bytes o 12 de 4, as que con los dos formatos el patrn se repite cada 48 bytes
+struct FillPattern {
+	unsigned char bytes[64];		// Un poco ms de 48 para poder empezar en cualquier fase del pxel
+	unsigned int bytes_per_pixel;
 
-	int dx = x1 - x0;		// Calculamos las coordenadas del vector director entre p0 y p1
-	int dy = y1 - y0;
+	FillPattern(const Color& c, unsigned int bytes_per_pixel) {
+		this->bytes_per_pixel = bytes_per_pixel;
+		for (int i = 0; i < 64; ++i) {
+			unsigned int channel = i % bytes_per_pixel;
+			bytes[i] = channel < 3 ? c.v[channel] : 255;		// El cuarto byte es el alfa (opaco)
+		}
+	}
+};
+
+// A partir de este tamao los rellenos se reparten entre los hilos y no pasan por la cach
+static const size_t FILL_PARALLEL_BYTES = 4 << 20;
+
+// Rellena size bytes con el patrn (dst tiene que empezar en un pxel). Con SSE2 se alinea el destino
+// a 16 bytes y se escriben 48 bytes por iteracin; stream usa escrituras que no pasan por la cach
+static void FillBytes(unsigned char* dst, size_t size, const FillPattern& pattern, bool stream)
+{
+#ifdef IMAGE_USE_SSE2
+	size_t head = (16 - ((size_t)dst & 15)) & 15;
+	if (head >= size) {
+		memcpy(dst, pattern.bytes, size);
+		return;
+	}
+	memcpy(dst, pattern.bytes, head);
+
+	// Fase del patrn en el primer byte alineado
+	const unsigned char* p = pattern.bytes + head % pattern.bytes_per_pixel;
+	const __m128i v0 = _mm_loadu_si128((const __m128i*)p);
+	const __m128i v1 = _mm_loadu_si128((const __m128i*)(p + 16));
+	const __m128i v2 = _mm_loadu_si128((const __m128i*)(p + 32));
+
+	unsigned char* d = dst + head;
+	size_t n = size - head;
+	if (stream) {
+		for (; n >= 48; n -= 48, d += 48) {
+			_mm_stream_si128((__m128i*)d, v0);
+			_mm_stream_si128((__m128i*)(d + 16), v1);
+			_mm_stream_si128((__m128i*)(d + 32), v2);
+		}
+		_mm_sfence();
+	}
+	else {
+		for (; n >= 48; n -= 48, d += 48) {
+			_mm_store_si128((__m128i*)d, v0);
+			_mm_store_si128((__m128i*)(d + 16), v1);
+			_mm_store_si128((__m128i*)(d + 32), v2);
+		}
+	}
+	memcpy(d, p, n);		// Lo que queda es menos de un patrn
+#else
+	for (size_t i = 0; i < size; i += 48)
+		memcpy(dst + i, pattern.bytes, std::min((size_t)48, size - i));
+#endif
+}
+
+// Rellena un bloque contiguo de pxeles; si es grande lo reparte en trozos mltiplos de 48 bytes entre los hilos
+static void FillBuffer(unsigned char* dst, size_t size, const FillPattern& pattern)
+{
+	if (size < FILL_PARALLEL_BYTES) {
+		FillBytes(dst, size, pattern, false);
+		return;
+	}
+
+	ThreadPool* pool = ThreadPool::Get();
+	size_t chunks = std::min((size_t)pool->GetNumThreads() * 2, size / (1 << 20));
+	size_t chunk_size = (size / chunks + 47) / 48 * 48;
+	chunks = (size + chunk_size - 1) / chunk_size;
+
+	pool->ParallelFor((int)chunks, [&](int i, int thread_index) {
+		size_t start = i * chunk_size;
+		FillBytes(dst + start, std::min(chunk_size, size - start), pattern, true);
+	});
+}
+
+// Fill the image with the color C (ignores the clip rect)
+void Image::Fill(const Color& c)
+{
+	if (!pixels) return;
+	if (track_dirty) {		// Fill no usa el recorte, as que toda la imagen queda modificada
+		DirtyRect r = { 0, 0, (int)width - 1, (int)height - 1 };
+		dirty_rects.assign(1, r);
+	}
+	FillBuffer((unsigned char*)pixels, (size_t)width * height * bytes_per_pixel, FillPattern(c, bytes_per_pixel));
+}
+
+// FUNCIN PARA RELLENAR UN RECTNGULO: SE RECORTA UNA VEZ Y LUEGO CADA FILA ES UN RELLENO CON ESCRITURAS ANCHAS
+void Image::FillRect(int x, int y, int w, int h, const Color& c)
+{
+	int cx0, cy0, cx1, cy1;
+	GetClipBounds(cx0, cy0, cx1, cy1);
+	int x0 = std::max(x, cx0), x1 = std::min(x + w - 1, cx1);
+	int y0 = std::max(y, cy0), y1 = std::min(y + h - 1, cy1);
+	if (w <= 0 || h <= 0 || x0 > x1 || y0 > y1) return;
+	if (track_dirty) MarkDirty(x0, y0, x1, y1);
+
+	const int count = x1 - x0 + 1;
+	if (count < 32) {		// Filas estrechas: no compensa preparar el patrn
+		for (int py = y0; py <= y1; ++py) {
+			if (bytes_per_pixel == 4)
+				std::fill(pixels32 + (size_t)py * width + x0, pixels32 + (size_t)py * width + x1 + 1, PackColor(c));
+			else
+				std::fill(pixels + (size_t)py * width + x0, pixels + (size_t)py * width + x1 + 1, c);
+		}
+		return;
+	}
+
+	FillPattern pattern(c, bytes_per_pixel);
+	const size_t row = (size_t)width * bytes_per_pixel;
+	unsigned char* dst = (unsigned char*)pixels + (size_t)y0 * row + (size_t)x0 * bytes_per_pixel;
+
+	if (x0 == 0 && x1 == (int)width - 1)		// Filas completas: es un solo bloque contiguo
+		FillBuffer(dst, row * (y1 - y0 + 1), pattern);
+	else
+		for (int py = y0; py <= y1; ++py, dst += row)
+			FillBytes(dst, (size_t)count * bytes_per_pixel, pattern, false);
+}
+
+// FUNCIN PARA DIBUJAR UN TRAMO HORIZONTAL DE PXELES (RECORTADO A LA IMAGEN)
+void Image::DrawSpan(int x0, int x1, int y, const Color& c) {
+
+	int cx0, cy0, cx1, cy1;
+	GetClipBounds(cx0, cy0, cx1, cy1);
+
+	if (y < cy0 || y > cy1) return;		// Recortamos el tramo una sola vez
+	x0 = std::max(x0, cx0);
+	x1 = std::min(x1, cx1);
+	if (x0 > x1) return;
+	if (track_dirty) MarkDirty(x0, y, x1, y);
+
+	int count = x1 - x0 + 1;
+	if (count >= 32) {		// Los tramos largos se rellenan con el patrn (escrituras de 16 bytes)
+		FillBytes((unsigned char*)pixels + ((size_t)y * width + x0) * bytes_per_pixel, (size_t)count * bytes_per_pixel, FillPattern(c, bytes_per_pixel), false);
+		return;
+	}
+
+	if (bytes_per_pixel == 4) {		// Con 4 bytes por pxel cada pxel es una palabra de 32 bits
+		uint32_t* p = pixels32 + (size_t)y * width + x0;
+		std::fill(p, p + count, PackColor(c));
+		return;
+	}
 
-	int steps = std::max(abs(dx), abs(dy));			// Calculamos los pasos necesarios para crear una lnea diagonal
+	Color* p = pixels + (size_t)y * width + x0;
+	std::fill(p, p + count, c);
+}
 
-	float incrementX = (float)dx / (float)steps;			// Calculamos la direccin para avanzar en cada iteracin
-	float incrementY = (float)dy / (float)steps;
+// BUCLES DE LAS LNEAS PARA CADA TIPO DE PXEL (Color O uint32_t)
+template <typename T>
+static inline void PlotColumn(T* p, T value, ptrdiff_t stride, int count)
+{
+	for (int i = 0; i < count; ++i, p += stride)
+		*p = value;
+}
+
+template <typename T>
+static inline void PlotLine(T* p, T value, ptrdiff_t majorStride, ptrdiff_t minorStride, int error, int errorStep, int errorMax, long long count)
+{
+	for (long long i = 0; i < count; i++) {
+		*p = value;		// Aqu dibujamos el pxel en las coordenadas actuales
+		p += majorStride;
+		error += errorStep;
+		if (error >= errorMax) {		// Cuando el error supera el umbral avanzamos tambin en el eje menor
+			error -= errorMax;
+			p += minorStride;
+		}
+	}
+}
 
-	float x = (float)x0;		// Inicializamos las coordenadas
-	float y = (float)y0;
+// FUNCIN PARA DIBUJAR LNEAS (BRESENHAM CON ARITMTICA ENTERA Y RECORTE PREVIO)
+void Image::DrawLineDDA(int x0, int y0, int x1, int y1, const Color& c) {
 
-	for (int i = 0; i <= steps; i++) {
-		SetPixel((unsigned int)round(x), (unsigned int)round(y), c);	// Aqu dibujamos el pxel en las coordenadas actuales
+	int cx0, cy0, cx1, cy1;
+	GetClipBounds(cx0, cy0, cx1, cy1);
+	if (cx0 > cx1 || cy0 > cy1) return;
+	if (track_dirty) MarkDirty(std::min(x0, x1), std::min(y0, y1), std::max(x0, x1), std::max(y0, y1));		// La caja de la lnea (se recorta dentro)
 
-		x += incrementX;		// Tenemos que incrementar las coordenadas para pintar cada pxel de la lnea
-		y += incrementY;
+	// Caso rpido: lneas horizontales, se pintan como un tramo
+	if (y0 == y1) {
+		DrawSpan(std::min(x0, x1), std::max(x0, x1), y0, c);
+		return;
 	}
+
+	// Caso rpido: lneas verticales, solo hay que recortar el rango de y
+	if (x0 == x1) {
+		if (x0 < cx0 || x0 > cx1) return;
+		int ya = std::max(std::min(y0, y1), cy0);
+		int yb = std::min(std::max(y0, y1), cy1);
+		if (bytes_per_pixel == 4)
+			PlotColumn(pixels32 + (size_t)ya * width + x0, PackColor(c), width, yb - ya + 1);
+		else
+			PlotColumn(pixels + (size_t)ya * width + x0, c, width, yb - ya + 1);
+		return;
+	}
+
+	int dx = x1 - x0;		// Calculamos las coordenadas del vector director entre p0 y p1
+	int dy = y1 - y0;
+
+	// El eje mayor avanza un pxel en cada paso, el menor solo cuando el error acumulado lo indica
+	bool xMajor = abs(dx) >= abs(dy);
+	int steps = xMajor ? abs(dx) : abs(dy);
+	int minorSteps = xMajor ? abs(dy) : abs(dx);
+	int major0 = xMajor ? x0 : y0;
+	int minor0 = xMajor ? y0 : x0;
+	int majorDir = (xMajor ? dx : dy) > 0 ? 1 : -1;
+	int minorDir = (xMajor ? dy : dx) > 0 ? 1 : -1;
+	int majorMin = xMajor ? cx0 : cy0;		// Lmites de recorte de cada eje
+	int majorMax = xMajor ? cx1 : cy1;
+	int minorMin = xMajor ? cy0 : cx0;
+	int minorMax = xMajor ? cy1 : cx1;
+
+	// En el paso i el eje menor se ha desplazado m(i) = (2*i*minorSteps + steps) / (2*steps) pxeles (redondeo al ms cercano)
+	// Recortamos la lnea buscando el rango de pasos [first, last] en el que los dos ejes caen dentro del recorte
+	long long first = 0, last = steps;
+
+	if (majorDir > 0) { first = std::max(first, (long long)majorMin - major0); last = std::min(last, (long long)majorMax - major0); }
+	else { first = std::max(first, (long long)major0 - majorMax); last = std::min(last, (long long)major0 - majorMin); }
+
+	long long minLo = minorDir > 0 ? (long long)minorMin - minor0 : (long long)minor0 - minorMax;		// Rango permitido para m(i)
+	long long minHi = minorDir > 0 ? (long long)minorMax - minor0 : (long long)minor0 - minorMin;
+	minLo = std::max(minLo, 0LL);
+	minHi = std::min(minHi, (long long)minorSteps);
+	if (minLo > minHi) return;
+
+	long long twoSteps = 2LL * steps;
+	long long twoMinor = 2LL * minorSteps;
+	if (minLo > 0)		// Primer paso con m(i) >= minLo
+		first = std::max(first, (twoSteps * minLo - steps + twoMinor - 1) / twoMinor);
+	if (minHi < minorSteps)		// ltimo paso con m(i) <= minHi
+		last = std::min(last, (twoSteps * (minHi + 1) - steps + twoMinor - 1) / twoMinor - 1);
+	if (first > last) return;
+
+	// Estado inicial del algoritmo en el primer paso visible
+	long long num = twoMinor * first + steps;
+	int m = (int)(num / twoSteps);
+	int error = (int)(num % twoSteps);
+
+	int major = major0 + majorDir * (int)first;
+	int minor = minor0 + minorDir * m;
+	int x = xMajor ? major : minor;
+	int y = xMajor ? minor : major;
+
+	// Desplazamientos en memoria de cada eje, as no hay que comprobar lmites en el bucle
+	ptrdiff_t row = (ptrdiff_t)width;
+	ptrdiff_t majorStride = xMajor ? majorDir : majorDir * row;
+	ptrdiff_t minorStride = xMajor ? minorDir * row : minorDir;
+
+	ptrdiff_t offset = (ptrdiff_t)y * row + x;
+	if (bytes_per_pixel == 4)
+		PlotLine(pixels32 + offset, PackColor(c), majorStride, minorStride, error, (int)twoMinor, (int)twoSteps, last - first + 1);
+	else
+		PlotLine(pixels + offset, c, majorStride, minorStride, error, (int)twoMinor, (int)twoSteps, last - first + 1);
 }
 
 
@@ -422,88 +1164,348 @@ void Image::DrawRect(int x, int y, int w, int h, const Color& borderColor, int b
 	// Completamos el interior del rectngulo en caso que la booleana isFilled sea True
 	if (isFilled)
 	{
-		for (int i = x; i < x + w; ++i)
-		{
-			for (int j = y; j < y + h; ++j)
-			{
-				SetPixel(i, j, fillColor);
+		FillRect(x, y, w, h, fillColor);		// Se recorta una vez y se rellena fila a fila con escrituras anchas
+	}
+}
+
+// ARISTA DE UN TRINGULO PARA EL RELLENO POR SCANLINES
+// Para cada fila calcula el tramo de x que ocupan los pxeles de la arista, usando los mismos pasos
+// de Bresenham que DrawLineDDA, as el relleno llega exactamente hasta el borde sin tabla ni memoria dinmica
+struct ScanEdge {
+	int x0, y0;
+	int yMin, yMax;			// Filas que toca la arista
+	int dirX, dirY;
+	int steps, minorSteps;
+	bool xMajor;
+
+	ScanEdge(int x0, int y0, int x1, int y1) {
+		int dx = x1 - x0;
+		int dy = y1 - y0;
+		this->x0 = x0;
+		this->y0 = y0;
+		yMin = std::min(y0, y1);
+		yMax = std::max(y0, y1);
+		dirX = dx > 0 ? 1 : -1;
+		dirY = dy > 0 ? 1 : -1;
+		xMajor = abs(dx) >= abs(dy);
+		steps = xMajor ? abs(dx) : abs(dy);
+		minorSteps = xMajor ? abs(dy) : abs(dx);
+	}
+
+	// Ampla [minX, maxX] con los pxeles de la arista en la fila y
+	inline void Extent(int y, int& minX, int& maxX) const {
+		if (y < yMin || y > yMax) return;
+
+		int a, b;
+		if (minorSteps == 0) {					// Arista horizontal (o un nico punto)
+			a = x0;
+			b = x0 + (xMajor ? dirX * steps : 0);
+		}
+		else if (!xMajor) {						// Un nico pxel por fila
+			long long i = (long long)(y - y0) * dirY;
+			long long m = (2 * i * minorSteps + steps) / (2LL * steps);
+			a = b = x0 + dirX * (int)m;
+		}
+		else {									// Varios pxeles por fila: pasos i con m(i) igual a la fila
+			long long m = (long long)(y - y0) * dirY;
+			long long twoSteps = 2LL * steps, twoMinor = 2LL * minorSteps;
+			long long first = m == 0 ? 0 : (twoSteps * m - steps + twoMinor - 1) / twoMinor;
+			long long last = m == minorSteps ? steps : (twoSteps * (m + 1) - steps + twoMinor - 1) / twoMinor - 1;
+			a = x0 + dirX * (int)first;
+			b = x0 + dirX * (int)last;
+		}
+		minX = std::min(minX, std::min(a, b));
+		maxX = std::max(maxX, std::max(a, b));
+	}
+};
+
+// RELLENO DE TRINGULOS POR SCANLINES
+void Image::FillTriangleScanline(int x0, int y0, int x1, int y1, int x2, int y2, const Color& c) {
+
+	ScanEdge e0(x0, y0, x1, y1);		// Las aristas en el mismo sentido en el que se dibuja el borde
+	ScanEdge e1(x1, y1, x2, y2);
+	ScanEdge e2(x0, y0, x2, y2);
+
+	// Solo recorremos las filas que ocupa el tringulo (recortadas)
+	int cx0, cy0, cx1, cy1;
+	GetClipBounds(cx0, cy0, cx1, cy1);
+	int yStart = std::max(std::min(y0, std::min(y1, y2)), cy0);
+	int yEnd = std::min(std::max(y0, std::max(y1, y2)), cy1);
+
+	for (int y = yStart; y <= yEnd; y++) {
+		int minX = INT_MAX;
+		int maxX = INT_MIN;
+		e0.Extent(y, minX, maxX);
+		e1.Extent(y, minX, maxX);
+		e2.Extent(y, minX, maxX);
+		if (minX <= maxX)
+			DrawSpan(minX, maxX, y, c);		// Pintamos todo el tramo de la fila de golpe
+	}
+}
+
+// ARISTA DE UN TRINGULO PARA EL RELLENO CON FUNCIONES DE ARISTA (HALF-SPACE)
+// E(x,y) = A*(x - xa) + B*(y - ya) es positiva dentro del tringulo y se actualiza sumando A o B al moverse un pxel
+struct HalfSpaceEdge {
+	int xa, ya;
+	int A, B;
+	int bias;		// Regla top-left: las aristas que no son superiores ni izquierdas no incluyen los pxeles que caen justo encima
+
+#ifdef IMAGE_USE_SSE2
+	__m128i stepLo, stepHi;		// A*(0,1,2,3) y A*(4,5,6,7) para evaluar 8 pxeles de una fila a la vez
+#endif
+
+	HalfSpaceEdge(int xa, int ya, int xb, int yb) {
+		this->xa = xa;
+		this->ya = ya;
+		A = ya - yb;
+		B = xb - xa;
+		bias = (A > 0 || (A == 0 && B < 0)) ? 0 : -1;
+#ifdef IMAGE_USE_SSE2
+		stepLo = _mm_setr_epi32(0, A, 2 * A, 3 * A);
+		stepHi = _mm_setr_epi32(4 * A, 5 * A, 6 * A, 7 * A);
+#endif
+	}
+
+	inline int At(int x, int y) const { return (int)((long long)A * (x - xa) + (long long)B * (y - ya)) + bias; }
+	inline int TileMin(int e) const { return e + std::min(0, 7 * A) + std::min(0, 7 * B); }		// Valor mnimo en las esquinas de un tile 8x8
+	inline int TileMax(int e) const { return e + std::max(0, 7 * A) + std::max(0, 7 * B); }
+};
+
+// Mscara de 8 bits con los pxeles de una fila de tile que estn dentro de las tres aristas (valores >= 0)
+static inline int CoverageMask8(const HalfSpaceEdge* edges, const int* e)
+{
+#ifdef IMAGE_USE_SSE2
+	__m128i lo = _mm_add_epi32(_mm_set1_epi32(e[0]), edges[0].stepLo);
+	__m128i hi = _mm_add_epi32(_mm_set1_epi32(e[0]), edges[0].stepHi);
+	lo = _mm_or_si128(lo, _mm_add_epi32(_mm_set1_epi32(e[1]), edges[1].stepLo));		// El OR tiene el bit de signo activo si alguna arista es negativa
+	hi = _mm_or_si128(hi, _mm_add_epi32(_mm_set1_epi32(e[1]), edges[1].stepHi));
+	lo = _mm_or_si128(lo, _mm_add_epi32(_mm_set1_epi32(e[2]), edges[2].stepLo));
+	hi = _mm_or_si128(hi, _mm_add_epi32(_mm_set1_epi32(e[2]), edges[2].stepHi));
+	int outside = _mm_movemask_ps(_mm_castsi128_ps(lo)) | (_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4);
+	return ~outside & 0xFF;
+#else
+	int mask = 0;
+	for (int i = 0; i < 8; ++i)
+		if (((e[0] + i * edges[0].A) | (e[1] + i * edges[1].A) | (e[2] + i * edges[2].A)) >= 0)
+			mask |= 1 << i;
+	return mask;
+#endif
+}
+
+// Pinta los pxeles de una fila de tile cuyo bit est activo en la mscara
+template <typename T>
+static inline void PlotMask8(T* row, T value, int mask)
+{
+	for (int i = 0; mask; ++i, mask >>= 1)
+		if (mask & 1)
+			row[i] = value;
+}
+
+// RELLENO DE TRINGULOS CON FUNCIONES DE ARISTA EVALUADAS EN TILES DE 8x8
+void Image::FillTriangleHalfSpace(int x0, int y0, int x1, int y1, int x2, int y2, const Color& c) {
+
+	// rea con signo: si es negativa cambiamos el orden para que el interior sea siempre positivo
+	long long area = (long long)(x1 - x0) * (y2 - y0) - (long long)(y1 - y0) * (x2 - x0);
+	if (area == 0) return;
+	if (area < 0) {
+		std::swap(x1, x2);
+		std::swap(y1, y2);
+	}
+
+	// Con coordenadas muy grandes las funciones de arista no caben en 32 bits
+	const int limit = 1 << 13;
+	if ((int)width >= limit || (int)height >= limit || abs(x0) >= limit || abs(y0) >= limit || abs(x1) >= limit || abs(y1) >= limit || abs(x2) >= limit || abs(y2) >= limit) {
+		FillTriangleScanline(x0, y0, x1, y1, x2, y2, c);
+		return;
+	}
+
+	// Caja contenedora recortada
+	int cx0, cy0, cx1, cy1;
+	GetClipBounds(cx0, cy0, cx1, cy1);
+	int minX = std::max(std::min(x0, std::min(x1, x2)), cx0);
+	int maxX = std::min(std::max(x0, std::max(x1, x2)), cx1);
+	int minY = std::max(std::min(y0, std::min(y1, y2)), cy0);
+	int maxY = std::min(std::max(y0, std::max(y1, y2)), cy1);
+	if (minX > maxX || minY > maxY) return;
+	if (track_dirty) MarkDirty(minX, minY, maxX, maxY);
+
+	HalfSpaceEdge edges[3] = { HalfSpaceEdge(x0, y0, x1, y1), HalfSpaceEdge(x1, y1, x2, y2), HalfSpaceEdge(x2, y2, x0, y0) };
+
+	for (int ty = minY & ~7; ty <= maxY; ty += 8) {
+		int rowStart = std::max(ty, minY);
+		int rowEnd = std::min(ty + 7, maxY);
+
+		for (int tx = minX & ~7; tx <= maxX; tx += 8) {
+			int colStart = std::max(tx, minX);
+			int colEnd = std::min(tx + 7, maxX);
+
+			int e[3];
+			bool inside = true;
+			bool outside = false;
+			for (int k = 0; k < 3; ++k) {
+				e[k] = edges[k].At(tx, ty);
+				outside = outside || edges[k].TileMax(e[k]) < 0;		// Todo el tile fuera de una arista: se descarta
+				inside = inside && edges[k].TileMin(e[k]) >= 0;			// Todo el tile dentro de las tres: se rellena sin comprobar
+			}
+			if (outside) continue;
+
+			if (inside) {
+				for (int y = rowStart; y <= rowEnd; ++y)
+					DrawSpan(colStart, colEnd, y, c);
+				continue;
+			}
+
+			// Tile parcial: evaluamos 8 pxeles por fila y solo dejamos las columnas dentro de la caja
+			int columns = ((0xFF << (colStart - tx)) & (0xFF >> (7 - (colEnd - tx)))) & 0xFF;
+			for (int y = rowStart; y <= rowEnd; ++y) {
+				int er[3] = { e[0] + (y - ty) * edges[0].B, e[1] + (y - ty) * edges[1].B, e[2] + (y - ty) * edges[2].B };
+				int mask = CoverageMask8(edges, er) & columns;
+				if (bytes_per_pixel == 4)
+					PlotMask8(pixels32 + (size_t)y * width + tx, PackColor(c), mask);
+				else
+					PlotMask8(pixels + (size_t)y * width + tx, c, mask);
 			}
 		}
 	}
 }
 
-// FUNCIN PARA ESCANEAR LAS LNEAS DE UN TRINGULO
-void Image::ScanLineDDA(int x0, int y0, int x1, int y1, std::vector<Cell>& table) {
-	
-	int dx = x1 - x0;		// Calculamos las coordenadas del vector director entre p0 y p1
-	int dy = y1 - y0;
+// Divisin entera redondeando hacia abajo tambin con negativos
+static inline long long FloorDiv(long long a, long long b)
+{
+	return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
 
-	int steps = std::max(abs(dx), abs(dy));			// Calculamos los pasos necesarios para crear una lnea diagonal
+// RELLENO DE TRINGULOS 3D CON TEST DE PROFUNDIDAD Y COLOR INTERPOLADO (FUNCIONES DE ARISTA CON 4 BITS DE SUBPXEL)
+void Image::DrawTriangleInterpolated(const Vector3& p0, const Vector3& p1, const Vector3& p2, const Color& c0, const Color& c1, const Color& c2, FloatImage* zbuffer) {
+
+	// Coordenadas en punto fijo (1/16 de pxel). Las que no son nmeros o estn muy lejos se descartan
+	// (el recorte contra el frustum ya deja los vrtices dentro de la pantalla)
+	const int SUB = 16;
+	const float limit = (float)(1 << 20);
+	const Vector3* p[3] = { &p0, &p1, &p2 };
+	const Color* c[3] = { &c0, &c1, &c2 };
+	long long x[3], y[3];
+	for (int k = 0; k < 3; ++k) {
+		if (!(fabs(p[k]->x) < limit && fabs(p[k]->y) < limit)) return;
+		x[k] = (long long)floor(p[k]->x * SUB + 0.5f);
+		y[k] = (long long)floor(p[k]->y * SUB + 0.5f);
+	}
 
-	float incrementX = (float)dx / (float)steps;			// Calculamos la direccin para avanzar en cada iteracin
-	float incrementY = (float)dy / (float)steps;
+	// Igual que en FillTriangleHalfSpace el interior tiene que ser positivo
+	long long area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+	if (area == 0) return;
+	if (area < 0) {
+		std::swap(x[1], x[2]); std::swap(y[1], y[2]);
+		std::swap(p[1], p[2]); std::swap(c[1], c[2]);
+		area = -area;
+	}
 
-	float x = (float)x0;		// Inicializamos las coordenadas
-	float y = (float)y0;
+	// Caja contenedora (pxeles cuyo centro puede estar dentro) recortada
+	int cx0, cy0, cx1, cy1;
+	GetClipBounds(cx0, cy0, cx1, cy1);
+	long long fminX = std::min(x[0], std::min(x[1], x[2])), fmaxX = std::max(x[0], std::max(x[1], x[2]));
+	long long fminY = std::min(y[0], std::min(y[1], y[2])), fmaxY = std::max(y[0], std::max(y[1], y[2]));
+	int minX = (int)std::max((long long)cx0, FloorDiv(fminX - SUB / 2 + SUB - 1, SUB));
+	int maxX = (int)std::min((long long)cx1, FloorDiv(fmaxX - SUB / 2, SUB));
+	int minY = (int)std::max((long long)cy0, FloorDiv(fminY - SUB / 2 + SUB - 1, SUB));
+	int maxY = (int)std::min((long long)cy1, FloorDiv(fmaxY - SUB / 2, SUB));
+	if (minX > maxX || minY > maxY) return;
+	if (track_dirty) MarkDirty(minX, minY, maxX, maxY);
+
+	if (zbuffer && (zbuffer->width != width || zbuffer->height != height || !zbuffer->pixels))
+		zbuffer = NULL;
+
+	// Arista k: la opuesta al vrtice k, su funcin vale el rea en ese vrtice y 0 en los otros dos (regla top-left con bias)
+	long long A[3], B[3], bias[3], rowE[3];
+	const long long sx = (long long)minX * SUB + SUB / 2, sy = (long long)minY * SUB + SUB / 2;		// Centro del primer pxel
+	for (int k = 0; k < 3; ++k) {
+		int a = (k + 1) % 3, b = (k + 2) % 3;
+		A[k] = y[a] - y[b];
+		B[k] = x[b] - x[a];
+		bias[k] = (A[k] > 0 || (A[k] == 0 && B[k] < 0)) ? 0 : -1;
+		rowE[k] = A[k] * (sx - x[a]) + B[k] * (sy - y[a]);
+	}
+
+	// Atributos (z, r, g, b) como planos: valor en el primer pxel y cunto cambian por columna y por fila
+	const double inv_area = 1.0 / (double)area;
+	double attr[4][3];
+	for (int k = 0; k < 3; ++k) {
+		attr[0][k] = p[k]->z;
+		attr[1][k] = c[k]->r; attr[2][k] = c[k]->g; attr[3][k] = c[k]->b;
+	}
+	double rowValue[4], dy[4];
+	float dx[4];
+	for (int i = 0; i < 4; ++i) {
+		rowValue[i] = (rowE[0] * attr[i][0] + rowE[1] * attr[i][1] + rowE[2] * attr[i][2]) * inv_area;
+		dx[i] = (float)((A[0] * attr[i][0] + A[1] * attr[i][1] + A[2] * attr[i][2]) * SUB * inv_area);
+		dy[i] = (B[0] * attr[i][0] + B[1] * attr[i][1] + B[2] * attr[i][2]) * SUB * inv_area;
+	}
 
-	for (int i = 0; i <= steps; i++) {		// Iteramos sobre cada paso
-		int currentY = (int)y;				// Convertimos Y a un nmero entero
-		if (currentY >= 0 && currentY < table.size()) {			// Necesitamos comprobar si currentY se encuentra dentro de los lmites de la tabla
-			table[currentY].minX = std::min(table[currentY].minX, (int)x);		// En caso de que eso pase entonces actualizamos minX y maxX para cada fila de la tabla
-			table[currentY].maxX = std::max(table[currentY].maxX, (int)x);
+	for (int py = minY; py <= maxY; ++py) {
+		long long e0 = rowE[0] + bias[0], e1 = rowE[1] + bias[1], e2 = rowE[2] + bias[2];
+		float z = (float)rowValue[0], r = (float)rowValue[1], g = (float)rowValue[2], b = (float)rowValue[3];
+		float* zrow = zbuffer ? zbuffer->pixels + (size_t)py * width : NULL;
+		size_t row = (size_t)py * width;
+
+		for (int px = minX; px <= maxX; ++px) {
+			if ((e0 | e1 | e2) >= 0 && (!zrow || z < zrow[px])) {
+				if (zrow) zrow[px] = z;
+				Color color((unsigned char)clamp(r + 0.5f, 0.0f, 255.0f), (unsigned char)clamp(g + 0.5f, 0.0f, 255.0f), (unsigned char)clamp(b + 0.5f, 0.0f, 255.0f));
+				if (bytes_per_pixel == 4)
+					pixels32[row + px] = PackColor(color);
+				else
+					pixels[row + px] = color;
+			}
+			e0 += A[0] * SUB; e1 += A[1] * SUB; e2 += A[2] * SUB;
+			z += dx[0]; r += dx[1]; g += dx[2]; b += dx[3];
 		}
-		x += incrementX;
-		y += incrementY;
+
+		for (int k = 0; k < 3; ++k)
+			rowE[k] += B[k] * SUB;
+		for (int i = 0; i < 4; ++i)
+			rowValue[i] += dy[i];
 	}
 }
 
 // FUNCIN PARA DIBUJAR TRINGULOS
 void Image::DrawTriangle(const Vector2& p0, const Vector2& p1, const Vector2& p2, const Color& borderColor, bool isFilled, const Color& fillColor) {
-	std::vector<Cell> table(height);	// Creamos una tabla con el mismo nmero de filas que la altura de la imagen
 
-	int x0 = (int)(p0.x);				// Estas son las coordenadas x e y de los tres puntos que frman el tringulo
+	int x0 = (int)(p0.x);				// Estas son las coordenadas x e y de los tres puntos que forman el tringulo
 	int y0 = (int)(p0.y);
 	int x1 = (int)(p1.x);
 	int y1 = (int)(p1.y);
 	int x2 = (int)(p2.x);
 	int y2 = (int)(p2.y);
 
-	ScanLineDDA(x0, y0, x1, y1, table);		// Rasterizamos los bordes del tringulo y actualizamos la tabla
-	ScanLineDDA(x1, y1, x2, y2, table);
-	ScanLineDDA(x2, y2, x0, y0, table);
+	if (isFilled) {			// Si queremos rellenar el tringulo usamos el algoritmo seleccionado
+		if (triangle_rasterizer == RASTERIZER_HALFSPACE)
+			FillTriangleHalfSpace(x0, y0, x1, y1, x2, y2, fillColor);
+		else
+			FillTriangleScanline(x0, y0, x1, y1, x2, y2, fillColor);
+	}
 
-	SetPixel(x0, y0, borderColor);			// Esto pinta el borde
-	SetPixel(x1, y1, borderColor);
-	SetPixel(x2, y2, borderColor);
-	DrawLineDDA(x0, y0, x1, y1, borderColor);
+	DrawLineDDA(x0, y0, x1, y1, borderColor);		// El borde se pinta encima del relleno
 	DrawLineDDA(x1, y1, x2, y2, borderColor);
 	DrawLineDDA(x0, y0, x2, y2, borderColor);
-
-	if (isFilled) {			// Si queremos rellenar el tringulo...
-		for (unsigned int y = 0; y < height; y++) {			// Iteramos entre la base y la altura del tringulo
-			if (table[y].minX <= table[y].maxX) {			// Si minX es menor que maxX...	
-				for (int x = table[y].minX; x <= table[y].maxX; x++) {		// Iteramos entre minX y maxX para cada fila
-					SetPixel(x, y, fillColor);		// Le damos color al pxel entre minX y maxX
-				}
-			}
-		}
-	}
 }
 
-// FUNCIN PARA DIBUJAR CRCULOS
+// FUNCIN PARA DIBUJAR CRCULOS (EL BORDE GRUESO ES UN ANILLO Y EL RELLENO UN DISCO, CADA TRAMO SE PINTA UNA SOLA VEZ)
 void Image::DrawCircle(int x0, int y0, int r, const Color& borderColor, int borderWidth, bool isFilled, const Color& fillColor)
 {
-	for (int i = 0; i < borderWidth; ++i)		// Aqu dibujamos el borde del crculo
+	if (borderWidth <= 0)		// Sin borde solo queda el relleno
 	{
-		MidpointCircle(x0, y0, r + i, borderColor);
+		if (isFilled)
+			MidpointCircleFill(x0, y0, r - 1, fillColor);
 	}
-
-	if (isFilled)		// Si es necesario lo rellenamos
+	else if (borderWidth == 1)		// El contorno fino sigue siendo el del punto medio, relleno o no
 	{
-		for (int i = 0; i < r; ++i)
-		{
-			MidpointCircleFill(x0, y0, i, fillColor);
-		}
+		MidpointCircle(x0, y0, r, borderColor);
+		if (isFilled)
+			MidpointCircleInterior(x0, y0, r, fillColor);
+	}
+	else		// Borde de radios r .. r + borderWidth - 1 y relleno de radio r - 1, sin huecos entre ellos
+	{
+		FillAnnulus(x0, y0, r, r + borderWidth - 1, borderColor, isFilled, fillColor);
 	}
 }
 
@@ -514,16 +1516,24 @@ void Image::MidpointCircle(int x0, int y0, int r, const Color& color)
 	int y = 0;			// Ini// Inicializamos y a 0
 	int p = 1 - r;		// Parmetro de decisin inicial
 
+	int cx0, cy0, cx1, cy1;
+	GetClipBounds(cx0, cy0, cx1, cy1);
+	if (track_dirty && r >= 0) MarkDirty(x0 - r, y0 - r, x0 + r, y0 + r);
+	auto plot = [&](int px, int py) {		// Pintamos el pxel solo si cae dentro del recorte
+		if (px >= cx0 && px <= cx1 && py >= cy0 && py <= cy1)
+			SetPixelUnsafe(px, py, color);
+	};
+
 	while (x >= y)
 	{
-		SetPixel(x0 + x, y0 + y, color);		// Dibujamos los 8 puntos simtricos del crculo
-		SetPixel(x0 - x, y0 + y, color);
-		SetPixel(x0 + x, y0 - y, color);
-		SetPixel(x0 - x, y0 - y, color);
-		SetPixel(x0 + y, y0 + x, color);
-		SetPixel(x0 - y, y0 + x, color);
-		SetPixel(x0 + y, y0 - x, color);
-		SetPixel(x0 - y, y0 - x, color);
+		plot(x0 + x, y0 + y);		// Dibujamos los 8 puntos simtricos del crculo
+		plot(x0 - x, y0 + y);
+		plot(x0 + x, y0 - y);
+		plot(x0 - x, y0 - y);
+		plot(x0 + y, y0 + x);
+		plot(x0 - y, y0 + x);
+		plot(x0 + y, y0 - x);
+		plot(x0 - y, y0 - x);
 
 		y++;		// Incrementamos y
 
@@ -539,30 +1549,86 @@ void Image::MidpointCircle(int x0, int y0, int r, const Color& color)
 	}
 }
 
-// ALGORITMO PARA RELLENAR UN CRCULO
+// ALGORITMO PARA RELLENAR UN CRCULO (UN TRAMO POR FILA)
 void Image::MidpointCircleFill(int x0, int y0, int r, const Color& color)
 {
-	int x = r;			// Inicializamos x para el radio
-	int y = 0;			// Ini// Inicializamos y a 0
-	int p = 1 - r;		// Parmetro de decisin inicial
+	FillAnnulus(x0, y0, 0, r, color, false, color);
+}
+
+// ALGORITMO PARA RELLENAR EL INTERIOR DEL CONTORNO DEL PUNTO MEDIO: se recorre el mismo contorno guardando, para cada
+// fila, el pxel del contorno ms cercano al centro, y se pinta el tramo que queda entre los de los dos lados
+void Image::MidpointCircleInterior(int x0, int y0, int r, const Color& color)
+{
+	if (r <= 0) return;
+	std::vector<int> inner(r + 1, r);		// Semiancho del contorno en cada fila (su pxel ms interior)
 
+	int x = r;
+	int y = 0;
+	int p = 1 - r;
 	while (x >= y)
 	{
-		DrawLineDDA(x0 - x, y0 + y, x0 + x, y0 + y, color);			// Dibujamos las lneas horizontales para rellenar el crculo
-		DrawLineDDA(x0 - x, y0 - y, x0 + x, y0 - y, color);
-		DrawLineDDA(x0 - y, y0 + x, x0 + y, y0 + x, color);
-		DrawLineDDA(x0 - y, y0 - x, x0 + y, y0 - x, color);
-
-		y++;		// Incrementamos y
-
+		inner[y] = std::min(inner[y], x);		// Los puntos (x, y) y (y, x) de los dos octantes
+		inner[x] = std::min(inner[x], y);
+		y++;
 		if (p <= 0)
+			p = p + 2 * y + 1;
+		else
 		{
-			p = p + 2 * y + 1;		// Si p <= 0 actualizamos el parmetro de decisin
+			x--;
+			p = p + 2 * y - 2 * x + 1;
 		}
-		else
+	}
+
+	for (int dy = 0; dy <= r; ++dy)
+	{
+		if (inner[dy] < 1) continue;		// La fila solo tiene contorno
+		DrawSpan(x0 - inner[dy] + 1, x0 + inner[dy] - 1, y0 + dy, color);		// DrawSpan recorta las filas
+		if (dy)
+			DrawSpan(x0 - inner[dy] + 1, x0 + inner[dy] - 1, y0 - dy, color);
+	}
+}
+
+// ALGORITMO PARA RELLENAR UN ANILLO: los pxeles del disco de radio outer que no estn en el de radio inner - 1.
+// Un pxel (dx, dy) est en el disco de radio R si dx + dy <= R + R (el mismo criterio que el punto medio).
+// El semiancho de cada fila solo decrece al alejarnos del centro, as que se calcula de forma incremental en O(R)
+void Image::FillAnnulus(int x0, int y0, int inner, int outer, const Color& color, bool fillInner, const Color& fillColor)
+{
+	if (outer < 0) return;
+	inner = std::max(inner, 0);
+	if (track_dirty) MarkDirty(x0 - outer, y0 - outer, x0 + outer, y0 + outer);		// As los tramos de cada fila ya estn contenidos
+
+	const long long outer2 = (long long)outer * outer + outer;
+	const int hole = inner - 1;			// Radio del disco interior (-1 si no hay agujero)
+	const long long hole2 = (long long)hole * hole + hole;
+
+	int cx0, cy0, cx1, cy1;
+	GetClipBounds(cx0, cy0, cx1, cy1);
+
+	int ho = outer;		// Semiancho del disco exterior en la fila actual
+	int hi = hole;		// Semiancho del disco interior (-1 cuando la fila ya no lo corta)
+
+	for (int dy = 0; dy <= outer; ++dy)
+	{
+		const long long dy2 = (long long)dy * dy;
+		while ((long long)ho * ho + dy2 > outer2) ho--;
+		if (dy > hole) hi = -1;
+		else while ((long long)hi * hi + dy2 > hole2) hi--;
+
+		// Las filas fuera del recorte no se pintan (pero los semianchos se siguen actualizando)
+		for (int side = 0; side < (dy ? 2 : 1); ++side)
 		{
-			x--;	// Reducimos x
-			p = p + 2 * y - 2 * x + 1;		// Si p > 0 actualizamos el parmetro de decisin
+			int y = side ? y0 - dy : y0 + dy;
+			if (y < cy0 || y > cy1) continue;
+
+			if (hi < 0)
+				DrawSpan(x0 - ho, x0 + ho, y, color);
+			else
+			{
+				DrawSpan(x0 - ho, x0 - hi - 1, y, color);		// Los dos tramos del anillo
+				DrawSpan(x0 + hi + 1, x0 + ho, y, color);
+				if (fillInner)
+					DrawSpan(x0 - hi, x0 + hi, y, fillColor);		// Y el interior
+			}
 		}
 	}
 }
@@ -574,8 +1640,9 @@ void Image::MidpointCircleFill(int x0, int y0, int r, const Color& color)
 // ForEachPixel( img, img2, [](Color a, Color b) { return a + b; } );
 template <typename F>
 void ForEachPixel(Image& img, const Image& img2, F f) {
-	for(unsigned int pos = 0; pos < img.width * img.height; ++pos)
-		img.pixels[pos] = f( img.pixels[pos], img2.pixels[pos] );
+	for(unsigned int y = 0; y < img.height; ++y)
+		for(unsigned int x = 0; x < img.width; ++x)
+			img.SetPixelUnsafe(x, y, f( img.GetPixel(x, y), img2.GetPixel(x, y) ));
 }
 
 #endif
@@ -7,6 +7,8 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
 #include <iostream>
 #include "framework.h"
 
@@ -24,12 +26,7 @@
 class FloatImage;
 class Entity;
 class Camera;
-
-// WE NEED TO CREATE A CELL STRUCT TO STORE THE MIN AND MAX TRIANGLES PIXELS POSITIONS
-struct Cell {
-	int minX = INT_MAX;		// Initially we compute the min and max possible values
-	int maxX = INT_MIN;
-};
+class ThreadPool;
 
 // A matrix of pixels
 class Image
@@ -43,15 +40,36 @@ class Image
 	} TGAInfo;
 
 public:
+	// FORMATOS DE PXEL: RGB8 USA EL Color DE 3 BYTES, RGBA8 EMPAQUETA CADA PXEL EN UN uint32_t (R, G, B, A EN MEMORIA)
+	// Con 4 bytes las filas quedan alineadas, se puede escribir con palabras de 32 bits y se conserva el alfa de los PNG
+	enum PixelFormat {
+		PIXEL_RGB8,
+		PIXEL_RGBA8
+	};
+
 	unsigned int width;
 	unsigned int height;
-	unsigned int bytes_per_pixel = 3; // Bits per pixel
+	unsigned int bytes_per_pixel = 3; // Bytes per pixel (3 = PIXEL_RGB8, 4 = PIXEL_RGBA8)
+
+	union {
+		Color* pixels;			// PIXEL_RGB8
+		uint32_t* pixels32;		// PIXEL_RGBA8
+	};
 
-	Color* pixels;
+	// Rectngulo de recorte (x, y, ancho, alto): las funciones Draw* solo escriben dentro de l
+	bool clip_enabled = false;
+	int clip_x = 0, clip_y = 0, clip_w = 0, clip_h = 0;
+
+	// Regiones modificadas (lmites incluidos) por Fill, FillRect, DrawImage y las funciones Draw* desde el ltimo
+	// ClearDirtyRects. Solo se registran si track_dirty est activo; SetPixel y los accesos directos no cuentan
+	struct DirtyRect { int x0, y0, x1, y1; };
+	static const int MAX_DIRTY_RECTS = 16;
+	bool track_dirty = false;
+	std::vector<DirtyRect> dirty_rects;
 
 	// Constructors
 	Image();
-	Image(unsigned int width, unsigned int height);
+	Image(unsigned int width, unsigned int height, PixelFormat format = PIXEL_RGB8);
 	Image(const Image& c);
 	Image& operator = (const Image& c); // Assign operator
 
@@ -60,34 +78,44 @@ public:
 
 	void Render();
 
+	PixelFormat GetFormat() const { return bytes_per_pixel == 4 ? PIXEL_RGBA8 : PIXEL_RGB8; }
+	void SetFormat(PixelFormat format); // Converts the pixels to the new format (alpha is 255 when it did not have it)
+
+	// Pack or unpack a Color in a PIXEL_RGBA8 pixel
+	static inline uint32_t PackColor(const Color& c, unsigned char a = 255) { unsigned char b[4] = { c.r, c.g, c.b, a }; uint32_t v; memcpy(&v, b, 4); return v; }
+	static inline Color UnpackColor(uint32_t v) { unsigned char b[4]; memcpy(b, &v, 4); Color c; c.r = b[0]; c.g = b[1]; c.b = b[2]; return c; }
+	static inline unsigned char UnpackAlpha(uint32_t v) { unsigned char b[4]; memcpy(b, &v, 4); return b[3]; }
+
 	// Get the pixel at position x,y
-	Color GetPixel(unsigned int x, unsigned int y) const { return pixels[ y * width + x ]; }
-	Color& GetPixelRef(unsigned int x, unsigned int y)	{ return pixels[ y * width + x ]; }
+	Color GetPixel(unsigned int x, unsigned int y) const { return bytes_per_pixel == 4 ? UnpackColor(pixels32[ y * width + x ]) : pixels[ y * width + x ]; }
+	// Only for PIXEL_RGB8: a PIXEL_RGBA8 pixel is not a Color (use GetPixel and SetPixelUnsafe)
+	Color& GetPixelRef(unsigned int x, unsigned int y)	{ assert(bytes_per_pixel == 3 && "GetPixelRef needs a PIXEL_RGB8 image"); return pixels[ y * width + x ]; }
 	Color GetPixelSafe(unsigned int x, unsigned int y) const {	
 		x = clamp((unsigned int)x, 0, width-1); 
 		y = clamp((unsigned int)y, 0, height-1); 
-		return pixels[ y * width + x ]; 
+		return GetPixel(x, y); 
 	}
+	unsigned char GetAlpha(unsigned int x, unsigned int y) const { return bytes_per_pixel == 4 ? UnpackAlpha(pixels32[ y * width + x ]) : 255; }
 
 	// Set the pixel at position x,y with value C
-	void SetPixel(unsigned int x, unsigned int y, const Color& c) { if(x < 0 || x > width-1) return; if(y < 0 || y > height-1) return; pixels[ y * width + x ] = c; }
-	inline void SetPixelUnsafe(unsigned int x, unsigned int y, const Color& c) { pixels[ y * width + x ] = c; }
+	void SetPixel(unsigned int x, unsigned int y, const Color& c) { if(x < 0 || x > width-1) return; if(y < 0 || y > height-1) return; SetPixelUnsafe(x, y, c); }
+	inline void SetPixelUnsafe(unsigned int x, unsigned int y, const Color& c) { if (bytes_per_pixel == 4) pixels32[ y * width + x ] = PackColor(c); else pixels[ y * width + x ] = c; }
 
 	void Resize(unsigned int width, unsigned int height);
 	void Scale(unsigned int width, unsigned int height);
 	
 	void FlipY(); // Flip the image top-down
 
-	// Fill the image with the color C
-	void Fill(const Color& c) { for(unsigned int pos = 0; pos < width*height; ++pos) pixels[pos] = c; }
+	// Fill the image with the color C (wide stores, big images are split between threads)
+	void Fill(const Color& c);
 
 	// Returns a new image with the area from (startx,starty) of size width,height
 	Image GetArea(unsigned int start_x, unsigned int start_y, unsigned int width, unsigned int height);
 
 	// Save or load images from the hard drive
-	bool LoadPNG(const char* filename, bool flip_y = true);
+	bool LoadPNG(const char* filename, bool flip_y = true); // The result is PIXEL_RGBA8 so the alpha is kept
 	bool LoadTGA(const char* filename, bool flip_y = false);
-	bool SaveTGA(const char* filename);
+	bool SaveTGA(const char* filename, bool res_path = true); // If res_path is false the filename is used as it is
 
 
 	// CON ESTO PODEMOS SABER CUAL ES EL TAMAO DE LA PANTALLA
@@ -95,30 +123,68 @@ public:
 	int GetHeight() const { return height; }
 
 
+	// FUNCIN PARA COPIAR OTRA IMAGEN EN LA POSICIN (x, y), SI TIENE ALFA SE MEZCLA CON LO QUE HABA
+	void DrawImage(const Image& image, int x, int y);
+
+	// FUNCIONES PARA LIMITAR EL DIBUJO A UN RECTNGULO (LAS USA EL TileRenderer PARA PINTAR CADA TILE)
+	void SetClipRect(int x, int y, int w, int h);
+	void ResetClipRect();
+	void GetClipBounds(int& x0, int& y0, int& x1, int& y1) const;
+
+	// FUNCIONES PARA LAS REGIONES MODIFICADAS (PARA REDIBUJAR Y SUBIR SOLO LO QUE HA CAMBIADO)
+	void MarkDirty(int x0, int y0, int x1, int y1);
+	void ClearDirtyRects() { dirty_rects.clear(); }
+	bool GetDirtyBounds(int& x0, int& y0, int& x1, int& y1) const;
+
 	// DECLARACIN FUNCIN DRAWPIXEL PARA POSTEIORMENTE USARLO PARA LA CREACIN DE PARTCULAS
 	void DrawPixel(int x, int y, const Color& color);
 
-	// FUNCIN PARA DIBUJAR LNEAS CON EL MTODO DDA
+	// FUNCIN PARA DIBUJAR LNEAS (BRESENHAM ENTERO, SE RECORTA A LA IMAGEN UNA SOLA VEZ)
 	void DrawLineDDA(int x0, int y0, int x1, int y1, const Color& c);
 
+	// FUNCIN PARA DIBUJAR UN TRAMO HORIZONTAL DESDE x0 HASTA x1 (AMBOS INCLUIDOS)
+	void DrawSpan(int x0, int x1, int y, const Color& c);
+
+	// FUNCIN PARA RELLENAR UN RECTNGULO SIN BORDE (RECORTADO)
+	void FillRect(int x, int y, int w, int h, const Color& c);
+
 	// FUNCIN PARA DIBUJAR RECTNGULOS
 	void DrawRect(int x, int y, int w, int h, const Color& borderColor, int borderWidth, bool isFilled, const Color& fillColor);
 
-	// FUNCIN PARA ESCANEAR LAS LNEAS DE UN TRINGULO
-	void ScanLineDDA(int x0, int y0, int x1, int y1, std::vector<Cell>& table);
+	// ALGORITMOS DISPONIBLES PARA RELLENAR TRINGULOS
+	enum TriangleRasterizer {
+		RASTERIZER_SCANLINE,	// Tramos por fila, solo recorre las filas que ocupa el tringulo
+		RASTERIZER_HALFSPACE	// Funciones de arista en tiles de 8x8 (SIMD), con regla top-left para no pintar dos veces las aristas compartidas
+	};
+	TriangleRasterizer triangle_rasterizer = RASTERIZER_SCANLINE;
 
-	// FUNCIN PARA DIBUJAR TRINGULOS
+	// FUNCIN PARA DIBUJAR TRINGULOS (EL RELLENO USA EL ALGORITMO triangle_rasterizer)
 	void DrawTriangle(const Vector2& p0, const Vector2& p1, const Vector2& p2, const Color& borderColor, bool isFilled, const Color& fillColor);
 
+	// FUNCIONES PARA RELLENAR TRINGULOS SIN BORDE CON CADA ALGORITMO
+	void FillTriangleScanline(int x0, int y0, int x1, int y1, int x2, int y2, const Color& c);
+	void FillTriangleHalfSpace(int x0, int y0, int x1, int y1, int x2, int y2, const Color& c);
+
+	// FUNCIN PARA RELLENAR UN TRINGULO 3D YA PROYECTADO: (x, y) EN PXELES Y z ES LA PROFUNDIDAD EN [0, 1]
+	// Interpola el color de los vrtices y solo pinta los pxeles ms cercanos que los del zbuffer (que actualiza).
+	// Sin zbuffer (o si no tiene el tamao de la imagen) no hay test de profundidad
+	void DrawTriangleInterpolated(const Vector3& p0, const Vector3& p1, const Vector3& p2, const Color& c0, const Color& c1, const Color& c2, FloatImage* zbuffer);
+
 	// FUNCIN PARA DIBUJAR CRCULOS
 	void DrawCircle(int x0, int y0, int r, const Color& borderColor, int borderWidth, bool isFilled, const Color& fillColor);
 
 	// ALGORITMO PARA DIBUJAR UN CRCULO
 	void MidpointCircle(int x0, int y0, int r, const Color& color);
 
-	// ALGORITMO PARA RELLENAR UN CRCULO
+	// ALGORITMO PARA RELLENAR UN CRCULO (UN TRAMO POR FILA)
 	void MidpointCircleFill(int x0, int y0, int r, const Color& color);
 
+	// ALGORITMO PARA RELLENAR EL INTERIOR DEL CONTORNO DE MidpointCircle (SIN TOCAR EL CONTORNO)
+	void MidpointCircleInterior(int x0, int y0, int r, const Color& color);
+
+	// ALGORITMO PARA RELLENAR UN ANILLO DE RADIOS inner..outer (Y SI fillInner TAMBIN SU INTERIOR CON fillColor)
+	void FillAnnulus(int x0, int y0, int inner, int outer, const Color& color, bool fillInner, const Color& fillColor);
+
 
 
 	// Used to easy code
@@ -130,11 +196,19 @@ public:
 	template <typename F>
 	Image& ForEachPixel( F callback )
 	{
-		for(unsigned int pos = 0; pos < width*height; ++pos)
-			pixels[pos] = callback(pixels[pos]);
+		if (bytes_per_pixel == 4)		// Se conserva el alfa de cada pxel
+			for(unsigned int pos = 0; pos < width*height; ++pos)
+				pixels32[pos] = PackColor(callback(UnpackColor(pixels32[pos])), UnpackAlpha(pixels32[pos]));
+		else
+			for(unsigned int pos = 0; pos < width*height; ++pos)
+				pixels[pos] = callback(pixels[pos]);
 		return *this;
 	}
 	#endif
+
+private:
+	static void* AllocatePixels(unsigned int width, unsigned int height, unsigned int bytes_per_pixel);
+	void FreePixels();
 };
 
 // Image storing one float per pixel instead of a 3 or 4 component Color
@@ -169,25 +243,113 @@ public:
 };
 
 
+// BLOQUE DE PARTCULAS
+// Las partculas se guardan en bloques de tamao fijo, cada uno como estructura de arrays (un array por atributo)
+// para poder actualizarlas de 4 en 4 con SIMD
+struct ParticleChunk {
+	static const int SIZE = 1024;
+
+	alignas(16) float x[SIZE];
+	alignas(16) float y[SIZE];
+	alignas(16) float vx[SIZE];		// Velocidad (direccin y rapidez) de la partcula
+	alignas(16) float vy[SIZE];
+	alignas(16) float ttl[SIZE];		// Tiempo que le queda a la partcula antes de expirar
+	alignas(16) float size[SIZE];		// Tamao de la partcula
+	unsigned char color[SIZE];			// ndice del color en la paleta
+
+	ParticleChunk* next;				// Siguiente bloque de la lista libre del pool
+};
+
+// POOL DE BLOQUES COMPARTIDO POR LOS EMISORES DE PARTCULAS
+// Los bloques libres forman una lista enlazada, as que pedir y devolver un bloque es O(1) y no reserva memoria si hay alguno libre.
+// Solo se guardan max_free bloques libres y el resto se liberan, as la memoria depende de las partculas vivas
+class ParticlePool {
+public:
+	int max_free;
+
+	ParticlePool(int max_free = 64);
+	~ParticlePool();
+
+	// Pool que usan los emisores por defecto
+	static ParticlePool* Get();
+
+	ParticleChunk* Allocate();
+	void Release(ParticleChunk* chunk);
+	void Trim();		// Libera todos los bloques libres
+
+	int GetNumAllocated() const { return num_allocated; }		// Bloques reservados (en uso y libres)
+	int GetNumFree() const { return num_free; }
+
+private:
+	ParticleChunk* free_list;
+	int num_free;
+	int num_allocated;
+};
+
+// PARMETROS DE UN EMISOR DE PARTCULAS (por defecto, la nieve del modo 6)
+struct ParticleEmitterParams {
+	int capacity = 3000;					// Mximo de partculas vivas a la vez
+	bool refill = true;						// Las que expiran se sustituyen en el mismo Update, as el emisor siempre est lleno
+	float spawn_rate = 0.0f;				// Partculas nuevas por segundo (adems de las que se crean con Emit)
+	float ttl_min = 50.0f, ttl_max = 150.0f;		// Tiempo de vida en segundos
+	float vx_min = 0.0f, vx_max = 0.0f;				// Velocidad en pxeles por segundo
+	float vy_min = -50.0f, vy_max = -10.0f;
+	int size_min = 1, size_max = 3;					// El cuadrado de la partcula mide 2 * size + 1
+	int bounds_x = 0, bounds_y = 0;					// Zona donde aparecen las partculas, las que salen de ella expiran
+	int bounds_width = 0, bounds_height = 0;		// 0 = el tamao del framebuffer
+	uint64_t seed = 0;								// Con la misma semilla se generan siempre las mismas partculas (0 = distinta en cada ejecucin)
+};
+
 // DEFINICIN DE LA FUNCIN PARA CREAR PARTCULAS
+// Es un emisor: las partculas vivas estn siempre juntas en [0, num_active), repartidas en bloques del pool (todos llenos salvo el ltimo).
+// Update mueve y compacta cada bloque en paralelo, despus rellena los huecos con las del final y devuelve al pool los bloques vacos.
+// Render reparte las partculas en franjas horizontales del framebuffer y cada hilo pinta las filas de sus franjas, sin bloqueos
 class ParticleSystem {
-	static const int MAX_PARTICLES = 3000;
-
-	struct Particle {
-		Vector2 position;
-		Vector2 velocity; // Normalized speed and direction of the particle
-		Color color;
-		float acceleration;
-		float ttl; // Time left until the particle expires
-		bool inactive; // Particle is not used/expired, so it can be recreated
-		float size; // Tamao de la partcula
+	ParticleEmitterParams params;
+	ParticlePool* pool;
+	ThreadPool* thread_pool;
+	std::vector<ParticleChunk*> chunks;
+
+	// Cuadrado de una partcula ya recortado al framebuffer (incluidos los bordes)
+	struct ParticleRect {
+		uint16_t x0, x1, y0, y1;
+		uint32_t color;
 	};
 
-	Particle particles[MAX_PARTICLES];
+	std::vector<int> chunk_live;				// Partculas vivas de cada bloque durante Update
+	std::vector<int> strip_offsets;				// Por cada grupo de bloques y franja, posicin de sus partculas en strip_particles
+	std::vector<int> strip_begin;				// Primera partcula de cada franja en strip_particles
+	std::vector<ParticleRect> strip_particles;	// Partculas de cada franja, en orden (se reutilizan entre fotogramas)
+
+	int num_active;
+	float spawn_accumulator;	// Parte de partcula que queda pendiente de spawn_rate
+	uint64_t seed;				// Semilla de los generadores de nmeros aleatorios
+	uint64_t spawn_counter;		// Partculas creadas hasta ahora
+
+	void Spawn(ParticleChunk* chunk, int i0, int i1, uint64_t stream) const;
+	ThreadPool* GetThreadPool() const;
 
 public:
-	void Init();
+	// Si pool es NULL se usa ParticlePool::Get() y si thread_pool es NULL, ThreadPool::Get()
+	ParticleSystem(ParticlePool* pool = NULL, ThreadPool* thread_pool = NULL);
+	~ParticleSystem();
+
+	ParticleSystem(const ParticleSystem&) = delete;
+	ParticleSystem& operator=(const ParticleSystem&) = delete;
+
+	// width y height son el tamao del framebuffer, se usan si los parmetros no indican la zona de emisin
+	void Init(int width, int height);
+	void Init(const ParticleEmitterParams& params, int width, int height);
+
+	// Crea count partculas ahora mismo (sin pasar de la capacidad) y devuelve cuntas se han creado
+	int Emit(int count);
+	void Clear();
+
 	void Render(Image* framebuffer);
 	void Update(float dt);
+
+	int GetNumActive() const { return num_active; }
+	int GetCapacity() const { return params.capacity; }
+	const ParticleEmitterParams& GetParams() const { return params; }
 };
 
@@ -0,0 +1,105 @@
+#include "mappedfile.h"
+
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+{
+	data = NULL;
+	size = 0;
+	is_open = false;
+#ifdef WIN32
+	file = mapping = NULL;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+bool MappedFile::Open(const char* filename)
+{
+	Close();
+
+#ifdef WIN32
+	HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(handle, &file_size))
+	{
+		CloseHandle(handle);
+		return false;
+	}
+	file = handle;
+	size = (size_t)file_size.QuadPart;
+
+	if (size > 0)
+	{
+		mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+		data = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+		if (!data)
+		{
+			Close();
+			return false;
+		}
+	}
+#else
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat stbuffer;
+	if (fstat(fd, &stbuffer) != 0)
+	{
+		close(fd);
+		return false;
+	}
+	size = (size_t)stbuffer.st_size;
+
+	if (size > 0)
+	{
+		void* address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (address == MAP_FAILED)
+		{
+			close(fd);
+			size = 0;
+			return false;
+		}
+		data = (const char*)address;
+	}
+	close(fd);		// The mapping keeps its own reference to the file
+#endif
+
+	if (!data)
+		data = "";	// Empty file: valid, but there is nothing to map
+	is_open = true;
+	return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef WIN32
+	if (is_open && size > 0 && data)
+		UnmapViewOfFile(data);
+	if (mapping)
+		CloseHandle((HANDLE)mapping);
+	if (file)
+		CloseHandle((HANDLE)file);
+	file = mapping = NULL;
+#else
+	if (is_open && size > 0)
+		munmap((void*)data, size);
+#endif
+	data = NULL;
+	size = 0;
+	is_open = false;
+}
@@ -0,0 +1,36 @@
+/*
+	+ Read-only view of a whole file mapped in memory (mmap, or MapViewOfFile on Windows).
+	+ Opening it does not read anything: the OS loads the pages when they are first accessed, so the data
+	  can be used where it is, without copying it into a buffer, and even huge files open immediately.
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const char* filename);
+	void Close();
+
+	bool IsOpen() const { return is_open; }
+	const char* GetData() const { return data; }
+	size_t GetSize() const { return size; }
+
+private:
+	const char* data;
+	size_t size;
+	bool is_open;
+#ifdef WIN32
+	void* file;
+	void* mapping;
+#endif
+
+	// The mapping belongs to a single object
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+};
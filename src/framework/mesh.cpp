@@ -1,13 +1,47 @@
 #include "mesh.h"
 #include "utils.h"
 #include "camera.h"
+#include "threadpool.h"
+#include "mappedfile.h"
+#include "texture.h"
+#include "shader.h"
 
 #include <string>
 #include <sys/stat.h>
 #include <cstring>
+#include <climits>
+#include <cstdio>
+#include <map>
+#include <algorithm>
+#include <cstddef>
+
+MeshMaterial::MeshMaterial()
+{
+	ambient = Vector3(0, 0, 0);
+	diffuse = Vector3(1, 1, 1);
+	specular = Vector3(0, 0, 0);
+	shininess = 0.0f;
+	opacity = 1.0f;
+	texture = NULL;
+	texture_loaded = false;
+}
 
 Mesh::Mesh()
 {
+	vertex_data = NULL;
+	index_data = NULL;
+	num_unique_vertices = num_indices = 0;
+	cache_file = NULL;
+	vertex_array = vertex_buffer = index_buffer = instance_buffer = 0;
+	vram_dirty = true;
+	has_normals = false;
+	has_uvs = false;
+}
+
+Mesh::~Mesh()
+{
+	ReleaseVRAM();
+	delete cache_file;
 }
 
 void Mesh::Clear()
@@ -15,11 +49,239 @@ void Mesh::Clear()
 	vertices.clear();
 	normals.clear();
 	uvs.clear();
+	unique_vertices.clear();
+	indices.clear();
+	vertex_data = NULL;
+	index_data = NULL;
+	num_unique_vertices = num_indices = 0;
+	delete cache_file;
+	cache_file = NULL;
+	materials.clear();
+	submeshes.clear();
+	vram_dirty = true;
+	has_normals = false;
+	has_uvs = false;
+	aabb_min = aabb_max = Vector3(0, 0, 0);
+}
+
+// The indexed data is the one in the vectors (not a cache file)
+void Mesh::UseIndexedVectors()
+{
+	vertex_data = unique_vertices.empty() ? NULL : &unique_vertices[0];
+	index_data = indices.empty() ? NULL : &indices[0];
+	num_unique_vertices = unique_vertices.size();
+	num_indices = indices.size();
+}
+
+void Mesh::ComputeBounds()
+{
+	const size_t count = IsIndexed() ? num_unique_vertices : vertices.size();
+	if (count == 0)
+	{
+		aabb_min = aabb_max = Vector3(0, 0, 0);
+		return;
+	}
+
+	aabb_min = aabb_max = IsIndexed() ? vertex_data[0].position : vertices[0];
+	for (size_t i = 1; i < count; ++i)
+	{
+		const Vector3& v = IsIndexed() ? vertex_data[i].position : vertices[i];
+		aabb_min.x = std::min(aabb_min.x, v.x); aabb_max.x = std::max(aabb_max.x, v.x);
+		aabb_min.y = std::min(aabb_min.y, v.y); aabb_max.y = std::max(aabb_max.y, v.y);
+		aabb_min.z = std::min(aabb_min.z, v.z); aabb_max.z = std::max(aabb_max.z, v.z);
+	}
+}
+
+// Points the arrays of the fixed pipeline to interleaved vertices at base (in memory, or NULL for the bound vertex buffer)
+void Mesh::SetVertexPointers(const char* base) const
+{
+	const GLsizei stride = sizeof(MeshVertex);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, stride, base + offsetof(MeshVertex, position));
+
+	// The arrays that are not used are disabled explicitly, because a VAO keeps them
+	if (HasNormals())
+	{
+		glEnableClientState(GL_NORMAL_ARRAY);
+		glNormalPointer(GL_FLOAT, stride, base + offsetof(MeshVertex, normal));
+	}
+	else
+		glDisableClientState(GL_NORMAL_ARRAY);
+
+	if (HasUVs())
+	{
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		glTexCoordPointer(2, GL_FLOAT, stride, base + offsetof(MeshVertex, uv));
+	}
+	else
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+}
+
+static inline void DrawElements(int primitive, size_t count, const unsigned int* first, int instances)
+{
+	if (instances == 1)
+		glDrawElements(primitive, static_cast<GLsizei>(count), GL_UNSIGNED_INT, first);
+	else
+		glDrawElementsInstanced(primitive, static_cast<GLsizei>(count), GL_UNSIGNED_INT, first, instances);
+}
+
+// Draws the indices (from first, in memory or NULL for the bound index buffer) with one draw per material,
+// binding its texture only once. With instances > 1 every draw is instanced, so the textures are bound once for all of them
+void Mesh::DrawSubMeshes(int primitive, const unsigned int* first, int instances)
+{
+	if (submeshes.empty())
+		DrawElements(primitive, num_indices, first, instances);
+
+	for (size_t i = 0; i < submeshes.size(); ++i)
+	{
+		const SubMesh& submesh = submeshes[i];
+		Texture* texture = NULL;
+		if (submesh.material >= 0)
+		{
+			MeshMaterial& material = materials[submesh.material];
+			if (!material.texture_loaded && !material.diffuse_map.empty())
+				material.texture = Texture::Get(material.diffuse_map.c_str());
+			material.texture_loaded = true;
+			texture = material.texture;
+		}
+
+		if (texture)
+			texture->Bind();
+		DrawElements(primitive, submesh.num_indices, first + submesh.first_index, instances);
+		if (texture)
+			texture->Unbind();
+	}
+}
+
+// Copies the vertices (and the indices) to buffers in the GPU if they have changed since the last upload.
+// Render calls it, so it is only needed to upload a mesh before its first frame. Returns false if the mesh
+// cannot be in VRAM (no vertices, or no vertex buffers because there is no GL context or it is too old)
+bool Mesh::UploadToVRAM()
+{
+	if (!vram_dirty)
+		return vertex_buffer != 0;
+
+	// Vertex buffers are core since OpenGL 1.5 and vertex array objects since 3.0
+	if (!(GLEW_VERSION_1_5 || GLEW_ARB_vertex_buffer_object))
+		return false;
+
+	const size_t count = IsIndexed() ? num_unique_vertices : vertices.size();
+	if (count == 0)
+	{
+		ReleaseVRAM();
+		vram_dirty = false;
+		return false;
+	}
+
+	// Triangle lists are interleaved like the vertices of indexed meshes, so both are drawn in the same way
+	std::vector<MeshVertex> interleaved;
+	const MeshVertex* data = vertex_data;
+	if (!IsIndexed())
+	{
+		interleaved.resize(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			interleaved[i].position = vertices[i];
+			interleaved[i].normal = i < normals.size() ? normals[i] : Vector3(0, 0, 0);
+			interleaved[i].uv = i < uvs.size() ? uvs[i] : Vector2(0, 0);
+		}
+		data = &interleaved[0];
+	}
+
+	if (!vertex_array && (GLEW_VERSION_3_0 || GLEW_ARB_vertex_array_object))
+		glGenVertexArrays(1, &vertex_array);
+	if (!vertex_buffer)
+		glGenBuffers(1, &vertex_buffer);
+	if (!index_buffer && IsIndexed())
+		glGenBuffers(1, &index_buffer);
+
+	if (vertex_array)
+		glBindVertexArray(vertex_array);
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	glBufferData(GL_ARRAY_BUFFER, count * sizeof(MeshVertex), data, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IsIndexed() ? index_buffer : 0);
+	if (IsIndexed())
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, num_indices * sizeof(unsigned int), index_data, GL_STATIC_DRAW);
+
+	// The VAO keeps the arrays and the index buffer, so drawing only has to bind it
+	if (vertex_array)
+	{
+		SetVertexPointers(NULL);
+		glBindVertexArray(0);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	vram_dirty = false;
+	return true;
+}
+
+void Mesh::ReleaseVRAM()
+{
+	if (vertex_array)
+		glDeleteVertexArrays(1, &vertex_array);
+	if (vertex_buffer)
+		glDeleteBuffers(1, &vertex_buffer);
+	if (index_buffer)
+		glDeleteBuffers(1, &index_buffer);
+	if (instance_buffer)
+		glDeleteBuffers(1, &instance_buffer);
+	vertex_array = vertex_buffer = index_buffer = instance_buffer = 0;
+	vram_dirty = true;
+}
+
+// Sets the copy in VRAM (uploaded) as the source of the draws: its VAO, or its buffers and the arrays of the fixed pipeline
+void Mesh::BindVRAM() const
+{
+	if (vertex_array)
+		glBindVertexArray(vertex_array);
+	else
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IsIndexed() ? index_buffer : 0);
+		SetVertexPointers(NULL);
+	}
+}
+
+void Mesh::UnbindVRAM() const
+{
+	if (vertex_array)
+		glBindVertexArray(0);
+	else
+	{
+		glDisableClientState(GL_VERTEX_ARRAY);
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
 }
 
 void Mesh::Render(int primitive)
 {
-	// Render the mesh using your rasterizer
+	// From the buffers in VRAM: the vertices are not sent again every frame
+	if (UploadToVRAM())
+	{
+		BindVRAM();
+		if (IsIndexed())
+			DrawSubMeshes(primitive, NULL);
+		else
+			glDrawArrays(primitive, 0, static_cast<GLsizei>(vertices.size()));
+		UnbindVRAM();
+		return;
+	}
+
+	// From memory
+	if (IsIndexed())
+	{
+		SetVertexPointers((const char*)vertex_data);
+		DrawSubMeshes(primitive, index_data);
+		glDisableClientState(GL_VERTEX_ARRAY);
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		return;
+	}
+
 	assert(vertices.size() && "No vertices in this mesh");
 
 	glEnableClientState(GL_VERTEX_ARRAY);
@@ -46,11 +308,79 @@ void Mesh::Render(int primitive)
 		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 }
 
+void Mesh::RenderInstanced(const Matrix44* models, int count, Shader* shader, int primitive)
+{
+	if (count <= 0)
+		return;
+
+	// A mat4 attribute takes four consecutive locations, one per column
+	const int location = shader ? shader->GetAttribLocation("a_model") : -1;
+
+	// Instanced arrays (glVertexAttribDivisor) are core since OpenGL 3.3
+	if (location == -1 || !GLEW_VERSION_3_3 || !UploadToVRAM())
+	{
+		// One draw per instance, with its model as the value of a_model, in u_model or in the modelview matrix
+		const bool use_uniform = location == -1 && shader && shader->IsVar("u_model");
+		const bool use_modelview = location == -1 && !use_uniform;
+		if (use_modelview)
+			glMatrixMode(GL_MODELVIEW);
+
+		for (int i = 0; i < count; ++i)
+		{
+			if (location != -1)
+			{
+				for (int column = 0; column < 4; ++column)
+					glVertexAttrib4fv(location + column, models[i].m + column * 4);
+			}
+			else if (use_uniform)
+				shader->SetMatrix44("u_model", models[i]);
+			else
+			{
+				glPushMatrix();
+				glMultMatrixf(models[i].m);
+			}
+
+			Render(primitive);
+
+			if (use_modelview)
+				glPopMatrix();
+		}
+		return;
+	}
+
+	BindVRAM();
+
+	// All the models in one buffer, read once per instance (divisor 1). It gets new storage every call (orphaning),
+	// so the driver does not have to wait for the draws that may still be reading the previous ones
+	if (!instance_buffer)
+		glGenBuffers(1, &instance_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+	glBufferData(GL_ARRAY_BUFFER, count * sizeof(Matrix44), models, GL_STREAM_DRAW);
+	for (int column = 0; column < 4; ++column)
+	{
+		glEnableVertexAttribArray(location + column);
+		glVertexAttribPointer(location + column, 4, GL_FLOAT, GL_FALSE, sizeof(Matrix44), (const char*)NULL + column * 4 * sizeof(float));
+		glVertexAttribDivisor(location + column, 1);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	if (IsIndexed())
+		DrawSubMeshes(primitive, NULL, count);
+	else
+		glDrawArraysInstanced(primitive, 0, static_cast<GLsizei>(vertices.size()), count);
+
+	// The VAO keeps the attribute arrays, so they are disabled for the next Render
+	for (int column = 0; column < 4; ++column)
+	{
+		glVertexAttribDivisor(location + column, 0);
+		glDisableVertexAttribArray(location + column);
+	}
+	UnbindVRAM();
+}
+
 void Mesh::CreateQuad()
 {
-	vertices.clear();
-	normals.clear();
-	uvs.clear();
+	Clear();		// Also the indexed mesh of a previous LoadOBJ
 
 	// Create six vertices (3 for upperleft triangle and 3 for lowerright)
 	vertices.push_back(Vector3(1, 1, 0));
@@ -67,13 +397,13 @@ void Mesh::CreateQuad()
 	uvs.push_back(Vector2(0, 1));
 	uvs.push_back(Vector2(1, 1));
 	uvs.push_back(Vector2(0, 0));
+
+	ComputeBounds();
 }
 
 void Mesh::CreatePlane(float size)
 {
-	vertices.clear();
-	normals.clear();
-	uvs.clear();
+	Clear();		// Also the indexed mesh of a previous LoadOBJ
 
 	// Create six vertices (3 for upperleft triangle and 3 for lowerright)
 
@@ -99,13 +429,13 @@ void Mesh::CreatePlane(float size)
 	uvs.push_back(Vector2(0, 1));
 	uvs.push_back(Vector2(1, 1));
 	uvs.push_back(Vector2(0, 0));
+
+	ComputeBounds();
 }
 
 void Mesh::CreateCube(float size)
 {
-	vertices.clear();
-	normals.clear();
-	uvs.clear();
+	Clear();		// Also the indexed mesh of a previous LoadOBJ
 
 	
 	vertices.push_back(Vector3(size,  size, size));
@@ -236,11 +566,533 @@ void Mesh::CreateCube(float size)
 	uvs.push_back(Vector2(0, 1));
 	uvs.push_back(Vector2(1, 1));
 	uvs.push_back(Vector2(0, 0));
+
+	ComputeBounds();
+}
+
+// Table from the OBJ indices of a face vertex (position, uv, normal) to its unique vertex.
+// The buckets are the positions: every position points to the first unique vertex that uses it and the rest are chained.
+// Faces use positions that are close in the file, so the lookups stay in cache (a general hash would jump all over memory)
+class VertexDeduplicator
+{
+public:
+	// Returns the unique vertex of the key, or adds it with the index next (they must be consecutive) and returns next
+	unsigned int FindOrAdd(int position, int uv, int normal, unsigned int next)
+	{
+		if ((size_t)position >= first.size())
+			first.resize(std::max((size_t)position + 1, first.size() * 2), (unsigned int)EMPTY);
+
+		for (unsigned int i = first[position]; i != EMPTY; i = vertices[i].next)
+			if (vertices[i].uv == uv && vertices[i].normal == normal)
+				return i;
+
+		Entry entry = { uv, normal, first[position] };
+		vertices.push_back(entry);
+		first[position] = next;
+		return next;
+	}
+
+private:
+	struct Entry { int uv, normal; unsigned int next; };
+	static const unsigned int EMPTY = 0xFFFFFFFFu;
+
+	std::vector<unsigned int> first;	// First unique vertex of every position
+	std::vector<Entry> vertices;		// Per unique vertex
+};
+
+// OBJ PARSING: every block of the file is parsed in place (it ends with a line break or a 0), without copying lines nor allocating per token
+
+static inline bool IsBlank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static inline bool IsDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline const char* SkipBlanks(const char* p)
+{
+	while (IsBlank(*p)) p++;
+	return p;
+}
+
+// Position after the end of the line
+static inline const char* SkipLine(const char* p)
+{
+	while (*p && *p != '\n') p++;
+	return *p ? p + 1 : p;
 }
 
-bool Mesh::LoadOBJ(const char* filename)
+// Decimal number with optional sign, fraction and exponent (like strtof, without hex, inf or nan).
+// Advances p after it and returns false (without moving p) if there is no number
+static bool ParseFloat(const char*& p, float& value)
+{
+	static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	const char* s = SkipBlanks(p);
+	bool negative = *s == '-';
+	if (*s == '-' || *s == '+') s++;
+
+	// Up to 19 significant digits fit in the mantissa, the rest only change the exponent
+	uint64_t mantissa = 0;
+	int exponent = 0, digits = 0;
+	bool any = false;
+	for (; IsDigit(*s); s++, any = true)
+	{
+		if (digits < 19) { mantissa = mantissa * 10 + (*s - '0'); digits += mantissa != 0; }
+		else exponent++;
+	}
+	if (*s == '.')
+	{
+		for (s++; IsDigit(*s); s++, any = true)
+			if (digits < 19) { mantissa = mantissa * 10 + (*s - '0'); digits += mantissa != 0; exponent--; }
+	}
+	if (!any)
+		return false;
+
+	if (*s == 'e' || *s == 'E')
+	{
+		const char* e = s + 1;
+		bool negative_exponent = *e == '-';
+		if (*e == '-' || *e == '+') e++;
+		if (IsDigit(*e))
+		{
+			int n = 0;
+			for (; IsDigit(*e); e++)
+				n = n < 10000 ? n * 10 + (*e - '0') : n;
+			exponent += negative_exponent ? -n : n;
+			s = e;
+		}
+	}
+
+	// The mantissa and the powers up to 1e22 are exact in a double, so the result is correctly rounded in the common cases
+	double v = (double)mantissa;
+	if (exponent < 0)
+		v = exponent >= -22 ? v / powers[-exponent] : v * pow(10.0, exponent);
+	else if (exponent > 0)
+		v = exponent <= 22 ? v * powers[exponent] : v * pow(10.0, exponent);
+
+	value = (float)(negative ? -v : v);
+	p = s;
+	return true;
+}
+
+// Integer with optional sign. Advances p after it and returns false (without moving p) if there is no number
+static bool ParseInt(const char*& p, int& value)
+{
+	const char* s = p;
+	bool negative = *s == '-';
+	if (*s == '-' || *s == '+') s++;
+	if (!IsDigit(*s))
+		return false;
+
+	int n = 0;
+	for (; IsDigit(*s); s++)
+		n = n < 214748364 ? n * 10 + (*s - '0') : n;
+	value = negative ? -n : n;
+	p = s;
+	return true;
+}
+
+// Rest of the line without the blanks around it (names of materials and files can have spaces)
+static std::string ParseName(const char* p)
+{
+	p = SkipBlanks(p);
+	const char* end = p;
+	while (*end && *end != '\n' && *end != '\r')
+		end++;
+	while (end > p && IsBlank(end[-1]))
+		end--;
+	return std::string(p, end);
+}
+
+// OBJ index (1 is the first element, -1 the last one read so far) to 1..count, or 0 if it is out of range
+static inline int ResolveIndex(int index, size_t count)
+{
+	if (index < 0)
+		index += (int)count + 1;
+	return index >= 1 && index <= (int)count ? index : 0;
+}
+
+// The file is read in blocks of whole lines (the memory used does not depend on its size) and every block is
+// split in chunks parsed by all the threads of the pool. Smaller blocks are parsed by a single thread
+static const size_t OBJ_CHUNK_BYTES = 1 << 20;
+static const size_t OBJ_CHUNKS_PER_THREAD = 4;		// Some per thread so they stay busy if the lines are not uniform
+
+// Face read by a chunk: its corners and the elements the chunk had read before it (for the relative indices)
+struct ObjFace
+{
+	int num_corners;
+	int positions, uvs, normals;
+};
+
+// usemtl read by a chunk: its faces from face on (and so its triangles from index on) use the material name
+struct ObjMaterialUse
+{
+	size_t face;
+	size_t index;
+	std::string name;
+};
+
+// Part of the file (whole lines) parsed by one thread. The indices of its faces can only be resolved when the
+// number of elements in the previous chunks is known, so the chunks are parsed first and stitched afterwards
+struct ObjChunk
+{
+	const char* begin;
+	const char* end;
+
+	std::vector<Vector3> positions;
+	std::vector<Vector3> normals;
+	std::vector<Vector2> uvs;
+	std::vector<ObjFace> faces;
+	std::vector<int> corners;				// (position, uv, normal) of every corner, as written and then resolved to 1..count
+	std::vector<ObjMaterialUse> material_uses;
+	std::vector<std::string> libraries;		// mtllib
+
+	size_t first_position, first_uv, first_normal;	// Elements of the previous chunks
+
+	std::vector<int> keys;					// (position, uv, normal) of the different vertices of the chunk, in order of appearance
+	std::vector<unsigned int> triangles;	// Three indices to keys per triangle
+	std::vector<unsigned int> remap;		// Unique vertex of the mesh of every key
+	unsigned int first_new_vertex;			// The unique vertices from here were added by this chunk
+	size_t first_index;						// Position of its triangles in the indices of the mesh
+};
+
+// Reads the vertices and faces of the lines of the chunk
+static void ParseOBJChunk(ObjChunk& chunk)
+{
+	// The chunks are reused by every block, keeping the memory of their vectors
+	chunk.positions.clear();
+	chunk.normals.clear();
+	chunk.uvs.clear();
+	chunk.faces.clear();
+	chunk.corners.clear();
+	chunk.material_uses.clear();
+	chunk.libraries.clear();
+	chunk.keys.clear();
+	chunk.triangles.clear();
+
+	const char* p = chunk.begin;
+	while (p < chunk.end && *p)
+	{
+		p = SkipBlanks(p);
+
+		if (p[0] == 'v' && IsBlank(p[1]))
+		{
+			p += 2;
+			Vector3 v;
+			if (ParseFloat(p, v.x) && ParseFloat(p, v.y) && ParseFloat(p, v.z))
+				chunk.positions.push_back(v);
+		}
+		else if (p[0] == 'v' && p[1] == 't' && IsBlank(p[2]))
+		{
+			p += 3;
+			Vector2 v;
+			if (ParseFloat(p, v.x) && ParseFloat(p, v.y))
+				chunk.uvs.push_back(v);
+		}
+		else if (p[0] == 'v' && p[1] == 'n' && IsBlank(p[2]))
+		{
+			p += 3;
+			Vector3 v;
+			if (ParseFloat(p, v.x) && ParseFloat(p, v.y) && ParseFloat(p, v.z))
+				chunk.normals.push_back(v);
+		}
+		else if (p[0] == 'f' && IsBlank(p[1]))
+		{
+			// Corners as v, v/vt, v//vn or v/vt/vn (0 = no uv or no normal). Faces with a wrong corner are skipped
+			p += 2;
+			const size_t first_corner = chunk.corners.size();
+			bool valid = true;
+			while (true)
+			{
+				p = SkipBlanks(p);
+				if (*p == 0 || *p == '\n' || *p == '\r' || *p == '#')
+					break;
+
+				int position = 0, uv = 0, normal = 0;
+				if (!ParseInt(p, position))
+				{
+					valid = false;
+					break;
+				}
+				if (*p == '/')
+				{
+					p++;
+					ParseInt(p, uv);
+					if (*p == '/')
+					{
+						p++;
+						ParseInt(p, normal);
+					}
+				}
+				while (*p && !IsBlank(*p) && *p != '\n' && *p != '\r')
+					p++;
+
+				chunk.corners.push_back(position);
+				chunk.corners.push_back(uv);
+				chunk.corners.push_back(normal);
+			}
+
+			const int num_corners = (int)(chunk.corners.size() - first_corner) / 3;
+			if (valid && num_corners >= 3)
+			{
+				ObjFace face = { num_corners, (int)chunk.positions.size(), (int)chunk.uvs.size(), (int)chunk.normals.size() };
+				chunk.faces.push_back(face);
+			}
+			else
+				chunk.corners.resize(first_corner);
+		}
+		else if (strncmp(p, "usemtl", 6) == 0 && IsBlank(p[6]))
+		{
+			ObjMaterialUse use = { chunk.faces.size(), 0, ParseName(p + 6) };
+			chunk.material_uses.push_back(use);
+		}
+		else if (strncmp(p, "mtllib", 6) == 0 && IsBlank(p[6]))
+			chunk.libraries.push_back(ParseName(p + 6));
+
+		p = SkipLine(p);	// Comments, empty lines and the statements that are not used
+	}
+}
+
+// Resolves the indices of the faces of the chunk and finds its different vertices (the triangles use them)
+static void ResolveOBJChunk(ObjChunk& chunk)
+{
+	// Negative indices are relative to the elements read before the face, also in the previous chunks
+	int* corner = chunk.corners.empty() ? NULL : &chunk.corners[0];
+	int min_position = INT_MAX;
+	for (size_t f = 0; f < chunk.faces.size(); ++f)
+	{
+		ObjFace& face = chunk.faces[f];
+		int face_min = INT_MAX;
+		for (int c = 0; c < face.num_corners; ++c, corner += 3)
+		{
+			corner[0] = ResolveIndex(corner[0], chunk.first_position + face.positions);
+			corner[1] = ResolveIndex(corner[1], chunk.first_uv + face.uvs);
+			corner[2] = ResolveIndex(corner[2], chunk.first_normal + face.normals);
+			face_min = std::min(face_min, corner[0]);
+		}
+		if (face_min == 0)
+			face.num_corners = -face.num_corners;	// Wrong position: its corners are still there, but it has no triangles
+		else
+			min_position = std::min(min_position, face_min);
+	}
+
+	// The positions of a chunk are usually close together, so the table of the deduplicator starts at the first one
+	VertexDeduplicator deduplicator;
+	std::vector<unsigned int> face_vertices;
+	corner = chunk.corners.empty() ? NULL : &chunk.corners[0];
+	size_t next_use = 0;
+	for (size_t f = 0; f < chunk.faces.size(); ++f)
+	{
+		for (; next_use < chunk.material_uses.size() && chunk.material_uses[next_use].face == f; ++next_use)
+			chunk.material_uses[next_use].index = chunk.triangles.size();
+
+		const ObjFace& face = chunk.faces[f];
+		if (face.num_corners < 0)
+		{
+			corner += -face.num_corners * 3;
+			continue;
+		}
+
+		face_vertices.resize(face.num_corners);
+		for (int c = 0; c < face.num_corners; ++c, corner += 3)
+		{
+			unsigned int next = (unsigned int)(chunk.keys.size() / 3);
+			face_vertices[c] = deduplicator.FindOrAdd(corner[0] - min_position, corner[1], corner[2], next);
+			if (face_vertices[c] == next)
+				chunk.keys.insert(chunk.keys.end(), corner, corner + 3);
+		}
+
+		// Polygons as triangle fans
+		for (int c = 1; c + 1 < face.num_corners; c++)
+		{
+			chunk.triangles.push_back(face_vertices[0]);
+			chunk.triangles.push_back(face_vertices[c]);
+			chunk.triangles.push_back(face_vertices[c + 1]);
+		}
+	}
+	for (; next_use < chunk.material_uses.size(); ++next_use)
+		chunk.material_uses[next_use].index = chunk.triangles.size();
+}
+
+// Stitches the chunks of every block to the mesh. The result is the same as parsing the whole file in order:
+// the elements keep their global numbering and the faces (and unique vertices) their order
+class ObjBlockParser
+{
+public:
+	ObjBlockParser(ThreadPool* pool, std::vector<MeshVertex>& unique_vertices, std::vector<unsigned int>& indices)
+		: pool(pool), unique_vertices(unique_vertices), indices(indices)
+	{
+		chunks.resize(pool->GetNumThreads() * OBJ_CHUNKS_PER_THREAD);
+		SubMesh no_material = { -1, 0, 0 };
+		material_runs.push_back(no_material);
+	}
+
+	size_t GetBlockSize() const { return chunks.size() * OBJ_CHUNK_BYTES; }
+	bool HasNormals() const { return !normals.empty(); }
+	bool HasUVs() const { return !uvs.empty(); }
+
+	// Materials in order of first use, the mtllib files and the ranges of indices of every usemtl (without num_indices)
+	const std::vector<std::string>& GetMaterialNames() const { return material_names; }
+	const std::vector<std::string>& GetLibraries() const { return libraries; }
+	std::vector<SubMesh>& GetMaterialRuns() { return material_runs; }
+
+	// Parses [begin, end), which ends after a line break (or with a 0 at the end of the file)
+	void ParseBlock(const char* begin, const char* end)
+	{
+		const size_t size = end - begin;
+		const size_t num_chunks = std::max((size_t)1, std::min(chunks.size(), size / OBJ_CHUNK_BYTES));
+		const char* chunk_begin = begin;
+		for (size_t i = 0; i < num_chunks; ++i)
+		{
+			const char* chunk_end = begin + size * (i + 1) / num_chunks;
+			if (chunk_end < chunk_begin) chunk_end = chunk_begin;
+			if (i + 1 < num_chunks)
+				chunk_end = SkipLine(chunk_end > begin && chunk_end[-1] == '\n' ? chunk_end - 1 : chunk_end);	// Just after the end of a line
+			chunks[i].begin = chunk_begin;
+			chunks[i].end = chunk_end;
+			chunk_begin = chunk_end;
+		}
+
+		pool->ParallelFor((int)num_chunks, [&](int i, int thread_index) {
+			ParseOBJChunk(chunks[i]);
+		});
+
+		const size_t first_position = positions.size(), first_uv = uvs.size(), first_normal = normals.size();
+		size_t num_positions = first_position, num_uvs = first_uv, num_normals = first_normal;
+		for (size_t i = 0; i < num_chunks; ++i)
+		{
+			chunks[i].first_position = num_positions;
+			chunks[i].first_uv = num_uvs;
+			chunks[i].first_normal = num_normals;
+			num_positions += chunks[i].positions.size();
+			num_uvs += chunks[i].uvs.size();
+			num_normals += chunks[i].normals.size();
+		}
+		positions.resize(num_positions);
+		uvs.resize(num_uvs);
+		normals.resize(num_normals);
+
+		pool->ParallelFor((int)num_chunks, [&](int i, int thread_index) {
+			ObjChunk& chunk = chunks[i];
+			std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + chunk.first_position);
+			std::copy(chunk.uvs.begin(), chunk.uvs.end(), uvs.begin() + chunk.first_uv);
+			std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + chunk.first_normal);
+			ResolveOBJChunk(chunk);
+		});
+
+		// The only serial step: the vertices of the chunks are merged in order, so the ones shared by several chunks are stored once
+		unsigned int num_unique = (unsigned int)unique_vertices.size();
+		size_t num_indices = indices.size();
+		for (size_t i = 0; i < num_chunks; ++i)
+		{
+			ObjChunk& chunk = chunks[i];
+			const size_t num_keys = chunk.keys.size() / 3;
+			chunk.remap.resize(num_keys);
+			chunk.first_new_vertex = num_unique;
+			for (size_t k = 0; k < num_keys; ++k)
+			{
+				const int* key = &chunk.keys[k * 3];
+				chunk.remap[k] = deduplicator.FindOrAdd(key[0], key[1], key[2], num_unique);
+				if (chunk.remap[k] == num_unique)
+					num_unique++;
+			}
+			chunk.first_index = num_indices;
+			for (size_t u = 0; u < chunk.material_uses.size(); ++u)
+				UseMaterial(chunk.material_uses[u].name, num_indices + chunk.material_uses[u].index);
+			libraries.insert(libraries.end(), chunk.libraries.begin(), chunk.libraries.end());
+			num_indices += chunk.triangles.size();
+		}
+
+		unique_vertices.resize(num_unique);
+		indices.resize(num_indices);
+
+		pool->ParallelFor((int)num_chunks, [&](int i, int thread_index) {
+			const ObjChunk& chunk = chunks[i];
+			for (size_t k = 0; k < chunk.remap.size(); ++k)
+			{
+				if (chunk.remap[k] < chunk.first_new_vertex)
+					continue;
+				const int* key = &chunk.keys[k * 3];
+				MeshVertex& vertex = unique_vertices[chunk.remap[k]];
+				vertex.position = positions[key[0] - 1];
+				vertex.normal = key[2] ? normals[key[2] - 1] : Vector3(0, 0, 0);
+				vertex.uv = key[1] ? uvs[key[1] - 1] : Vector2(0, 0);
+			}
+			for (size_t t = 0; t < chunk.triangles.size(); ++t)
+				indices[chunk.first_index + t] = chunk.remap[chunk.triangles[t]];
+		});
+	}
+
+private:
+	ThreadPool* pool;
+	std::vector<ObjChunk> chunks;		// Reused by every block
+
+	// The indices from first_index on use the material name
+	void UseMaterial(const std::string& name, size_t first_index)
+	{
+		std::map<std::string, int>::iterator it = material_ids.find(name);
+		int material = it != material_ids.end() ? it->second : (int)material_names.size();
+		if (it == material_ids.end())
+		{
+			material_ids[name] = material;
+			material_names.push_back(name);
+		}
+
+		SubMesh& last = material_runs.back();
+		if (last.first_index == first_index)
+		{
+			// The last run has no faces: it is replaced (or joined to the previous one if it has the same material)
+			last.material = material;
+			if (material_runs.size() > 1 && material_runs[material_runs.size() - 2].material == material)
+				material_runs.pop_back();
+		}
+		else if (last.material != material)
+		{
+			SubMesh run = { material, (unsigned int)first_index, 0 };
+			material_runs.push_back(run);
+		}
+	}
+
+	// Everything read so far (the faces can use any previous element)
+	std::vector<Vector3> positions;
+	std::vector<Vector3> normals;
+	std::vector<Vector2> uvs;
+	VertexDeduplicator deduplicator;
+
+	std::vector<std::string> material_names;
+	std::map<std::string, int> material_ids;
+	std::vector<std::string> libraries;
+	std::vector<SubMesh> material_runs;
+
+	std::vector<MeshVertex>& unique_vertices;
+	std::vector<unsigned int>& indices;
+};
+
+// Size and modification time of a file, to know if it has changed since its cache was written. The time is in
+// nanoseconds where the file system has them (st_mtime only has seconds, a file rewritten in the same second would not change)
+static bool GetFileStamp(const std::string& path, uint64_t& size, int64_t& mtime)
+{
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0)
+		return false;
+
+	size = (uint64_t)info.st_size;
+#if defined(WIN32)
+	mtime = (int64_t)info.st_mtime * 1000000000;
+#elif defined(__APPLE__)
+	mtime = (int64_t)info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+	mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+	return true;
+}
+
+bool Mesh::LoadOBJ(const char* filename, bool use_cache)
 {
-	struct stat stbuffer;
 	std::cout << "Loading mesh: " << filename << std::endl;
 
 	std::string relPath = absResPath(filename);
@@ -252,97 +1104,421 @@ bool Mesh::LoadOBJ(const char* filename)
 		return false;
 	}
 
-	stat(relPath.c_str(), &stbuffer);
+	uint64_t source_size = 0;
+	int64_t source_mtime = 0;
+	GetFileStamp(relPath, source_size, source_mtime);
+	Clear();
 
-	unsigned int size = stbuffer.st_size;
-	char* data = new char[size + 1];
-	fread(data, size, 1, f);
-	fclose(f);
-	data[size] = 0;
+	// The cache of this same version of the file has the result ready to use
+	const std::string cache_path = relPath + ".cache";
+	if (use_cache && LoadCache(cache_path, source_size, source_mtime))
+	{
+		fclose(f);
+		return true;
+	}
 
-	char* pos = data;
-	char line[255];
-	int i = 0;
+	// Only one block of lines is in memory, the bytes after its last line break are moved to the start of the next one
+	ObjBlockParser parser(ThreadPool::Get(), unique_vertices, indices);
+	std::vector<char> buffer(std::min(parser.GetBlockSize(), (size_t)source_size) + 1);
+	size_t filled = 0;
+	while (true)
+	{
+		filled += fread(&buffer[filled], 1, buffer.size() - 1 - filled, f);
+		const bool end_of_file = filled < buffer.size() - 1;
+		buffer[filled] = 0;		// The last line of the file may have no line break
 
-	std::vector<Vector3> indexed_positions;
-	std::vector<Vector3> indexed_normals;
-	std::vector<Vector2> indexed_uvs;
+		size_t used = filled;
+		if (!end_of_file)
+		{
+			while (used > 0 && buffer[used - 1] != '\n')
+				used--;
+			if (used == 0)
+			{
+				buffer.resize(buffer.size() * 2);	// A line longer than the whole block
+				continue;
+			}
+		}
 
-	const float max_float = 10000000;
-	const float min_float = -10000000;
+		parser.ParseBlock(&buffer[0], &buffer[0] + used);
+		if (end_of_file)
+			break;
 
-	unsigned int vertex_i = 0;
+		memmove(&buffer[0], &buffer[used], filled - used);
+		filled -= used;
+	}
+	fclose(f);
 
-	//parse file
-	while (*pos != 0)
+	// The materials used by the faces, with the properties of the MTL files (their paths are relative to the OBJ)
+	const std::string name = filename;
+	const std::string folder = name.substr(0, name.find_last_of("\\/") + 1);
+	const std::vector<std::string>& material_names = parser.GetMaterialNames();
+	materials.resize(material_names.size());
+	for (size_t i = 0; i < material_names.size(); ++i)
+		materials[i].name = material_names[i];
+	std::vector<std::string> libraries;
+	for (size_t i = 0; i < parser.GetLibraries().size(); ++i)
 	{
-		if (*pos == '\n') pos++;
-		if (*pos == '\r') pos++;
+		libraries.push_back(folder + parser.GetLibraries()[i]);
+		LoadMTL(libraries.back(), folder);
+	}
+	GroupByMaterial(parser.GetMaterialRuns());
+
+	has_normals = parser.HasNormals();
+	has_uvs = parser.HasUVs();
+	UseIndexedVectors();
+	ComputeBounds();
 
-		//read one line
-		i = 0;
-		while (i < 255 && pos[i] != '\n' && pos[i] != '\r' && pos[i] != 0) i++;
-		std::memcpy(line, pos, i);
-		line[i] = 0;
-		pos = pos + i;
+	if (use_cache)
+		SaveCache(cache_path, source_size, source_mtime, libraries);
+
+	return true;
+}
 
-		//std::cout << "Line: \"" << line << "\"" << std::endl;
-		if (*line == '#' || *line == 0) continue; //comment
+// Reads the properties of the materials of the table that are in the MTL file (the others are not used)
+void Mesh::LoadMTL(const std::string& filename, const std::string& folder)
+{
+	FILE* f = fopen(absResPath(filename).c_str(), "rb");
+	if (f == NULL)
+	{
+		std::cerr << "Material library not found: " << filename << std::endl;
+		return;
+	}
 
-		//tokenize line
-		std::vector<std::string> tokens = tokenize(line, " ");
+	std::string text;
+	char buffer[4096];
+	for (size_t n; (n = fread(buffer, 1, sizeof(buffer), f)) > 0; )
+		text.append(buffer, n);
+	fclose(f);
 
-		if (tokens.empty()) continue;
+	MeshMaterial* material = NULL;
+	const char* p = text.c_str();
+	while (*p)
+	{
+		p = SkipBlanks(p);
 
-		if (tokens[0] == "v" && tokens.size() == 4)
+		if (strncmp(p, "newmtl", 6) == 0 && IsBlank(p[6]))
 		{
-			Vector3 v(std::stof(tokens[1].c_str()), std::stof(tokens[2].c_str()), std::stof(tokens[3].c_str()));
-			indexed_positions.push_back(v);
+			const std::string name = ParseName(p + 6);
+			material = NULL;
+			for (size_t i = 0; i < materials.size() && !material; ++i)
+				if (materials[i].name == name)
+					material = &materials[i];
 		}
-		else if (tokens[0] == "vt" && (tokens.size() == 4 || tokens.size() == 3))
+		else if (material && p[0] == 'K' && (p[1] == 'a' || p[1] == 'd' || p[1] == 's') && IsBlank(p[2]))
 		{
-			Vector2 v(std::stof(tokens[1].c_str()), std::stof(tokens[2].c_str()));
-			indexed_uvs.push_back(v);
+			// A single value is a gray
+			Vector3& color = p[1] == 'a' ? material->ambient : p[1] == 'd' ? material->diffuse : material->specular;
+			const char* q = p + 2;
+			if (ParseFloat(q, color.x) && !(ParseFloat(q, color.y) && ParseFloat(q, color.z)))
+				color.y = color.z = color.x;
 		}
-		else if (tokens[0] == "vn" && tokens.size() == 4)
+		else if (material && p[0] == 'N' && p[1] == 's' && IsBlank(p[2]))
 		{
-			Vector3 v(std::stof(tokens[1].c_str()), std::stof(tokens[2].c_str()), std::stof(tokens[3].c_str()));
-			indexed_normals.push_back(v);
+			const char* q = p + 2;
+			ParseFloat(q, material->shininess);
 		}
-		else if (tokens[0] == "f" && tokens.size() >= 4)
+		else if (material && p[0] == 'd' && IsBlank(p[1]))
 		{
-			Vector3 v1, v2, v3;
-			v1 = parseVector3(tokens[1].c_str(), '/');
+			const char* q = p + 1;
+			ParseFloat(q, material->opacity);
+		}
+		else if (material && p[0] == 'T' && p[1] == 'r' && IsBlank(p[2]))
+		{
+			const char* q = p + 2;
+			float transparency;
+			if (ParseFloat(q, transparency))
+				material->opacity = 1.0f - transparency;
+		}
+		else if (material && strncmp(p, "map_Kd", 6) == 0 && IsBlank(p[6]))
+		{
+			// The file is the last token (the ones before are options like -s or -bm)
+			std::string map = ParseName(p + 6);
+			size_t last_blank = map.find_last_of(" \t");
+			if (map[0] == '-' && last_blank != std::string::npos)
+				map = map.substr(last_blank + 1);
+			std::replace(map.begin(), map.end(), '\\', '/');
+			material->diffuse_map = folder + map;
+		}
 
-			for (size_t iPoly = 2; iPoly < tokens.size() - 1; iPoly++)
-			{
-				v2 = parseVector3(tokens[iPoly].c_str(), '/');
-				v3 = parseVector3(tokens[iPoly + 1].c_str(), '/');
+		p = SkipLine(p);
+	}
+}
 
-				vertices.push_back(indexed_positions[(unsigned int)(v1.x) - 1]);
-				vertices.push_back(indexed_positions[(unsigned int)(v2.x) - 1]);
-				vertices.push_back(indexed_positions[(unsigned int)(v3.x) - 1]);
-				//triangles.push_back( VECTOR_INDICES_TYPE(vertex_i, vertex_i+1, vertex_i+2) ); //not needed
-				vertex_i += 3;
+// Sorts the triangles by material, keeping their order inside every one, so each material is a single SubMesh.
+// runs are the ranges of the file that use the same material
+void Mesh::GroupByMaterial(std::vector<SubMesh>& runs)
+{
+	for (size_t i = 0; i < runs.size(); ++i)
+		runs[i].num_indices = (i + 1 < runs.size() ? runs[i + 1].first_index : (unsigned int)indices.size()) - runs[i].first_index;
 
-				if (indexed_uvs.size() > 0)
-				{
-					uvs.push_back(indexed_uvs[(unsigned int)(v1.y) - 1]);
-					uvs.push_back(indexed_uvs[(unsigned int)(v2.y) - 1]);
-					uvs.push_back(indexed_uvs[(unsigned int)(v3.y) - 1]);
-				}
+	// One submesh per material, in order of first use
+	std::vector<int> submesh_of_material(materials.size() + 1, -1);		// material + 1, so -1 has its place
+	size_t num_runs = 0;
+	submeshes.clear();
+	for (size_t i = 0; i < runs.size(); ++i)
+	{
+		if (runs[i].num_indices == 0)
+			continue;
+		int& submesh = submesh_of_material[runs[i].material + 1];
+		if (submesh < 0)
+		{
+			submesh = (int)submeshes.size();
+			SubMesh empty = { runs[i].material, 0, 0 };
+			submeshes.push_back(empty);
+		}
+		submeshes[submesh].num_indices += runs[i].num_indices;
+		num_runs++;
+	}
 
-				if (indexed_normals.size() > 0)
-				{
-					normals.push_back(indexed_normals[(unsigned int)(v1.z) - 1]);
-					normals.push_back(indexed_normals[(unsigned int)(v2.z) - 1]);
-					normals.push_back(indexed_normals[(unsigned int)(v3.z) - 1]);
-				}
+	unsigned int first_index = 0;
+	for (size_t i = 0; i < submeshes.size(); ++i)
+	{
+		submeshes[i].first_index = first_index;
+		first_index += submeshes[i].num_indices;
+	}
+
+	// If every material is in a single run the triangles are already grouped
+	if (num_runs == submeshes.size())
+		return;
+
+	std::vector<unsigned int> grouped(indices.size());
+	std::vector<unsigned int> next_index(submeshes.size());
+	for (size_t i = 0; i < submeshes.size(); ++i)
+		next_index[i] = submeshes[i].first_index;
+	for (size_t i = 0; i < runs.size(); ++i)
+	{
+		if (runs[i].num_indices == 0)
+			continue;
+		unsigned int& next = next_index[submesh_of_material[runs[i].material + 1]];
+		std::copy(indices.begin() + runs[i].first_index, indices.begin() + runs[i].first_index + runs[i].num_indices, grouped.begin() + next);
+		next += runs[i].num_indices;
+	}
+	indices.swap(grouped);
+}
+
+// BINARY CACHE: header, vertices (MeshVertex), indices, submeshes, the MTL files and the material table, in the byte order
+// of the machine that wrote it. The parsed data is stored exactly as the Mesh uses it, so the big parts are mapped and used in place
+
+static const char MESH_CACHE_MAGIC[8] = { 'M', 'E', 'S', 'H', 'B', 'I', 'N', 0 };
+static const uint32_t MESH_CACHE_VERSION = 4;
+
+enum { MESH_CACHE_NORMALS = 1, MESH_CACHE_UVS = 2 };
+
+struct MeshCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t vertex_size;		// sizeof(MeshVertex), a different layout needs a new cache
+	uint64_t source_size;		// Size and modification time of the OBJ (see GetFileStamp), if they change the cache is not valid
+	int64_t source_mtime;
+	uint64_t num_vertices;
+	uint64_t num_indices;
+	float aabb_min[3];
+	float aabb_max[3];
+	uint32_t flags;
+	uint32_t num_submeshes;
+	uint32_t num_materials;
+	uint32_t num_libraries;
+	uint64_t materials_size;	// Bytes of the MTL files and the material table, at the end of the file
+};
+
+static_assert(sizeof(MeshCacheHeader) % 16 == 0, "The vertices of the cache must start aligned");
+static_assert(sizeof(SubMesh) == 12, "SubMesh is stored as it is in the cache");
+
+// MTL files of the cache: path and whether it was found, with its size and modification time. The materials come from them,
+// so the cache is not valid if any of them changes, appears or disappears.
+// Materials of the cache: name, ambient, diffuse, specular, shininess, opacity and diffuse map (strings with their size first)
+static void WriteString(std::string& table, const std::string& text)
+{
+	uint32_t size = (uint32_t)text.size();
+	table.append((const char*)&size, sizeof(size));
+	table.append(text);
+}
+
+static bool ReadBytes(const char*& p, const char* end, void* data, size_t size)
+{
+	if ((size_t)(end - p) < size)
+		return false;
+	memcpy(data, p, size);
+	p += size;
+	return true;
+}
+
+static bool ReadString(const char*& p, const char* end, std::string& text)
+{
+	uint32_t size;
+	if (!ReadBytes(p, end, &size, sizeof(size)) || (size_t)(end - p) < size)
+		return false;
+	text.assign(p, size);
+	p += size;
+	return true;
+}
+
+// The stamp of an MTL file as it is stored in the cache
+struct MeshCacheLibraryStamp
+{
+	uint32_t found;
+	uint32_t padding;
+	uint64_t size;
+	int64_t mtime;
+};
+
+static MeshCacheLibraryStamp GetLibraryStamp(const std::string& filename)
+{
+	MeshCacheLibraryStamp stamp;
+	memset(&stamp, 0, sizeof(stamp));
+	if (!GetFileStamp(absResPath(filename), stamp.size, stamp.mtime))
+		stamp.size = stamp.mtime = 0;
+	else
+		stamp.found = 1;
+	return stamp;
+}
+
+bool Mesh::LoadCache(const std::string& cache_path, uint64_t source_size, int64_t source_mtime)
+{
+	MappedFile* file = new MappedFile();
+	if (!file->Open(cache_path.c_str()) || file->GetSize() < sizeof(MeshCacheHeader))
+	{
+		delete file;
+		return false;
+	}
+
+	const MeshCacheHeader* header = (const MeshCacheHeader*)file->GetData();
+	const uint64_t data_size = file->GetSize() - sizeof(MeshCacheHeader);
+	bool valid = memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) == 0 &&
+		header->version == MESH_CACHE_VERSION && header->vertex_size == sizeof(MeshVertex) &&
+		header->source_size == source_size && header->source_mtime == source_mtime &&
+		header->num_vertices <= data_size / sizeof(MeshVertex) && header->num_indices <= data_size / sizeof(unsigned int) &&
+		header->num_submeshes <= data_size / sizeof(SubMesh) && header->materials_size <= data_size &&
+		header->num_vertices * sizeof(MeshVertex) + header->num_indices * sizeof(unsigned int) +
+		header->num_submeshes * sizeof(SubMesh) + header->materials_size == data_size;
+
+	// The small parts are copied: the submeshes (checked against the indices) and the material table
+	std::vector<SubMesh> cached_submeshes(valid ? header->num_submeshes : 0);
+	std::vector<MeshMaterial> cached_materials(valid ? header->num_materials : 0);
+	if (valid)
+	{
+		const char* p = file->GetData() + sizeof(MeshCacheHeader) + header->num_vertices * sizeof(MeshVertex) + header->num_indices * sizeof(unsigned int);
+		const char* end = file->GetData() + file->GetSize();
+		for (size_t i = 0; i < cached_submeshes.size() && valid; ++i)
+		{
+			SubMesh& submesh = cached_submeshes[i];
+			valid = ReadBytes(p, end, &submesh, sizeof(SubMesh)) && submesh.material >= -1 && submesh.material < (int)header->num_materials &&
+				submesh.first_index <= header->num_indices && submesh.num_indices <= header->num_indices - submesh.first_index;
+		}
+		for (uint32_t i = 0; i < header->num_libraries && valid; ++i)
+		{
+			std::string library;
+			MeshCacheLibraryStamp cached, current;
+			valid = ReadString(p, end, library) && ReadBytes(p, end, &cached, sizeof(cached));
+			if (valid)
+			{
+				current = GetLibraryStamp(library);
+				valid = cached.found == current.found && cached.size == current.size && cached.mtime == current.mtime;
 			}
 		}
+		for (size_t i = 0; i < cached_materials.size() && valid; ++i)
+		{
+			MeshMaterial& material = cached_materials[i];
+			valid = ReadString(p, end, material.name) &&
+				ReadBytes(p, end, &material.ambient, sizeof(Vector3)) && ReadBytes(p, end, &material.diffuse, sizeof(Vector3)) &&
+				ReadBytes(p, end, &material.specular, sizeof(Vector3)) && ReadBytes(p, end, &material.shininess, sizeof(float)) &&
+				ReadBytes(p, end, &material.opacity, sizeof(float)) && ReadString(p, end, material.diffuse_map);
+		}
 	}
 
-	delete[] data;
+	// A corrupt index would make the draws read outside of the vertices, so they are checked once here
+	if (valid && header->num_indices)
+	{
+		const unsigned int* cached_indices = (const unsigned int*)(file->GetData() + sizeof(MeshCacheHeader) + header->num_vertices * sizeof(MeshVertex));
+		unsigned int max_index = 0;
+		for (size_t i = 0; i < header->num_indices; ++i)
+			max_index = std::max(max_index, cached_indices[i]);
+		valid = max_index < header->num_vertices;
+	}
+	if (!valid)
+	{
+		delete file;
+		return false;
+	}
 
+	// The vertices are not read here: the pages are loaded the first time they are used
+	cache_file = file;
+	num_unique_vertices = (size_t)header->num_vertices;
+	num_indices = (size_t)header->num_indices;
+	vertex_data = num_unique_vertices ? (const MeshVertex*)(file->GetData() + sizeof(MeshCacheHeader)) : NULL;
+	index_data = num_indices ? (const unsigned int*)(file->GetData() + sizeof(MeshCacheHeader) + num_unique_vertices * sizeof(MeshVertex)) : NULL;
+	submeshes.swap(cached_submeshes);
+	materials.swap(cached_materials);
+	has_normals = (header->flags & MESH_CACHE_NORMALS) != 0;
+	has_uvs = (header->flags & MESH_CACHE_UVS) != 0;
+	aabb_min = Vector3(header->aabb_min[0], header->aabb_min[1], header->aabb_min[2]);
+	aabb_max = Vector3(header->aabb_max[0], header->aabb_max[1], header->aabb_max[2]);
 	return true;
 }
+
+void Mesh::SaveCache(const std::string& cache_path, uint64_t source_size, int64_t source_mtime, const std::vector<std::string>& libraries) const
+{
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+	header.version = MESH_CACHE_VERSION;
+	header.vertex_size = sizeof(MeshVertex);
+	header.source_size = source_size;
+	header.source_mtime = source_mtime;
+	header.num_vertices = num_unique_vertices;
+	header.num_indices = num_indices;
+	for (int i = 0; i < 3; ++i)
+	{
+		header.aabb_min[i] = aabb_min.v[i];
+		header.aabb_max[i] = aabb_max.v[i];
+	}
+	header.flags = (has_normals ? MESH_CACHE_NORMALS : 0) | (has_uvs ? MESH_CACHE_UVS : 0);
+	header.num_submeshes = (uint32_t)submeshes.size();
+	header.num_materials = (uint32_t)materials.size();
+	header.num_libraries = (uint32_t)libraries.size();
+
+	std::string material_table;
+	for (size_t i = 0; i < libraries.size(); ++i)
+	{
+		MeshCacheLibraryStamp stamp = GetLibraryStamp(libraries[i]);
+		WriteString(material_table, libraries[i]);
+		material_table.append((const char*)&stamp, sizeof(stamp));
+	}
+	for (size_t i = 0; i < materials.size(); ++i)
+	{
+		const MeshMaterial& material = materials[i];
+		WriteString(material_table, material.name);
+		material_table.append((const char*)&material.ambient, sizeof(Vector3));
+		material_table.append((const char*)&material.diffuse, sizeof(Vector3));
+		material_table.append((const char*)&material.specular, sizeof(Vector3));
+		material_table.append((const char*)&material.shininess, sizeof(float));
+		material_table.append((const char*)&material.opacity, sizeof(float));
+		WriteString(material_table, material.diffuse_map);
+	}
+	header.materials_size = material_table.size();
+
+	// It is written with another name and renamed at the end, so a cache is never read half written
+	const std::string temp_path = cache_path + ".tmp";
+	FILE* f = fopen(temp_path.c_str(), "wb");
+	if (f == NULL)
+		return;		// e.g. read-only resources, the file will be parsed again the next time
+
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	if (ok && num_unique_vertices)
+		ok = fwrite(vertex_data, sizeof(MeshVertex), num_unique_vertices, f) == num_unique_vertices;
+	if (ok && num_indices)
+		ok = fwrite(index_data, sizeof(unsigned int), num_indices, f) == num_indices;
+	if (ok && !submeshes.empty())
+		ok = fwrite(&submeshes[0], sizeof(SubMesh), submeshes.size(), f) == submeshes.size();
+	if (ok && !material_table.empty())
+		ok = fwrite(material_table.data(), 1, material_table.size(), f) == material_table.size();
+	ok = fclose(f) == 0 && ok;
+
+	remove(cache_path.c_str());		// rename does not replace files on Windows
+	if (!ok || rename(temp_path.c_str(), cache_path.c_str()) != 0)
+	{
+		std::cerr << "Could not write the mesh cache: " << cache_path << std::endl;
+		remove(temp_path.c_str());
+	}
+}
@@ -1,33 +1,152 @@
 /*
 	The Mesh contains the info about how to render a mesh and also how to parse it from a file.
+	The meshes created in code are stored as triangle lists (three consecutive vertices per triangle, in vertices, normals and uvs).
+	The meshes loaded from OBJ files are indexed: every different (position, uv, normal) combination is stored once as
+	a MeshVertex and the triangles are three indices to them, so the shared vertices are not stored nor transformed again.
+	Parsing an OBJ is slow, so LoadOBJ saves the result next to it in a binary cache (file.obj.cache) and the next time
+	it maps the cache in memory and uses its vertices and indices directly, without parsing nor copying anything.
+	The materials of the OBJ (usemtl, from the files of its mtllib) are in a table and the triangles are grouped by
+	material, one SubMesh per material, so every material (and its texture) is set once per draw.
+	Render draws from vertex (and index) buffers in VRAM inside a VAO, uploaded the first time and again only if the mesh changes.
+	RenderInstanced draws many copies of the mesh with one instanced draw call per material, with the model matrices in one buffer.
 */
 
 #pragma once
 
 #include <vector>
+#include <string>
+#include <stdint.h>
 #include "framework.h"
 #include "camera.h"
 #include "main/includes.h"
 
+// Vertex of an indexed mesh, with all its attributes together (interleaved)
+struct MeshVertex
+{
+	Vector3 position;
+	Vector3 normal;
+	Vector2 uv;
+};
+
+class MappedFile;
+class Texture;
+class Shader;
+
+// Material of an MTL file. Only the diffuse texture is used
+struct MeshMaterial
+{
+	std::string name;
+	Vector3 ambient;			// Ka
+	Vector3 diffuse;			// Kd
+	Vector3 specular;			// Ks
+	float shininess;			// Ns
+	float opacity;				// d (or 1 - Tr)
+	std::string diffuse_map;	// map_Kd, relative to the res folder
+	Texture* texture;			// Loaded the first time the mesh is rendered with OpenGL
+	bool texture_loaded;
+
+	MeshMaterial();
+};
+
+// Range of the indices of an indexed mesh that uses the same material (-1 = no material)
+struct SubMesh
+{
+	int material;
+	unsigned int first_index;
+	unsigned int num_indices;
+};
+
+
 class Mesh
 {
+	// Triangle lists
 	std::vector<Vector3> vertices;
 	std::vector<Vector3> normals;
 	std::vector<Vector2> uvs;
 
+	// Indexed meshes: vertex_data and index_data point to unique_vertices and indices, or inside the mapped cache file
+	std::vector<MeshVertex> unique_vertices;
+	std::vector<unsigned int> indices;
+	const MeshVertex* vertex_data;
+	const unsigned int* index_data;
+	size_t num_unique_vertices;
+	size_t num_indices;
+	MappedFile* cache_file;
+	bool has_normals;
+	bool has_uvs;
+
+	// Triangles grouped by material (indexed meshes)
+	std::vector<MeshMaterial> materials;
+	std::vector<SubMesh> submeshes;
+
+	// Copy in VRAM (0 = not created)
+	GLuint vertex_array;
+	GLuint vertex_buffer;
+	GLuint index_buffer;
+	GLuint instance_buffer;	// Model matrices of the last RenderInstanced
+	bool vram_dirty;		// The mesh has changed since the last upload
+
+	// Bounding box of the vertices
+	Vector3 aabb_min;
+	Vector3 aabb_max;
+
+	void UseIndexedVectors();
+	void ComputeBounds();
+	void LoadMTL(const std::string& filename, const std::string& folder);
+	void GroupByMaterial(std::vector<SubMesh>& runs);
+	void SetVertexPointers(const char* base) const;
+	void BindVRAM() const;
+	void UnbindVRAM() const;
+	void DrawSubMeshes(int primitive, const unsigned int* first, int instances = 1);
+	bool LoadCache(const std::string& cache_path, uint64_t source_size, int64_t source_mtime);
+	void SaveCache(const std::string& cache_path, uint64_t source_size, int64_t source_mtime, const std::vector<std::string>& libraries) const;
+
+	// The data can point to the mapping of its own cache file
+	Mesh(const Mesh&) = delete;
+	Mesh& operator=(const Mesh&) = delete;
+
 public:
 
 	Mesh();
+	~Mesh();
 	void Clear();
 	void Render(int primitive = GL_TRIANGLES);
 
+	// Draws count copies of the mesh, one per model matrix. The enabled shader reads the model of every instance from
+	// the attribute "mat4 a_model" (see instanced.vs). Without it, or without instancing (OpenGL 3.3), it draws
+	// every instance on its own with the model in the uniform u_model, or in the modelview matrix if there is no shader
+	void RenderInstanced(const Matrix44* models, int count, Shader* shader = NULL, int primitive = GL_TRIANGLES);
+
+	// Needs a GL context. Render uploads the mesh when needed, so calling it is optional
+	bool UploadToVRAM();
+	void ReleaseVRAM();
+
 	void CreatePlane(float size);
 	void CreateCube(float size);
 	void CreateQuad();
 
-	bool LoadOBJ(const char* filename);
+	// use_cache = false always parses the OBJ (and does not write its cache)
+	bool LoadOBJ(const char* filename, bool use_cache = true);
 
+	// Triangle lists (empty for indexed meshes)
 	const std::vector<Vector3>& GetVertices() { return vertices; }
 	const std::vector<Vector3>& GetNormals() { return normals; }
 	const std::vector<Vector2>& GetUVs() { return uvs; }
+
+	// Indexed meshes: three indices to GetUniqueVertices per triangle
+	bool IsIndexed() const { return num_indices != 0; }
+	const MeshVertex* GetUniqueVertices() const { return vertex_data; }
+	size_t GetNumUniqueVertices() const { return num_unique_vertices; }
+	const unsigned int* GetIndices() const { return index_data; }
+	bool HasNormals() const { return IsIndexed() ? has_normals : !normals.empty(); }
+	bool HasUVs() const { return IsIndexed() ? has_uvs : !uvs.empty(); }
+
+	size_t GetNumVertices() const { return IsIndexed() ? num_indices : vertices.size(); }	// Three per triangle
+	size_t GetNumTriangles() const { return GetNumVertices() / 3; }
+
+	const std::vector<MeshMaterial>& GetMaterials() const { return materials; }
+	const std::vector<SubMesh>& GetSubMeshes() const { return submeshes; }
+
+	const Vector3& GetAABBMin() const { return aabb_min; }
+	const Vector3& GetAABBMax() const { return aabb_max; }
 };
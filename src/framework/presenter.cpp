@@ -0,0 +1,155 @@
+#include "presenter.h"
+#include "utils.h"
+
+FramebufferPresenter::FramebufferPresenter()
+{
+	shader = NULL;
+	num_buffers = 0;
+	current_pbo = 0;
+	width = height = bytes_per_pixel = 0;
+	full_upload = true;
+	uploaded_rows = 0;
+}
+
+FramebufferPresenter::~FramebufferPresenter()
+{
+	Release();
+}
+
+bool FramebufferPresenter::Init(int num_buffers)
+{
+	this->num_buffers = std::max(1, num_buffers);
+
+	shader = Shader::Get("shaders/quad.vs", "shaders/quad.fs");
+	if (!shader)
+	{
+		std::cerr << "FramebufferPresenter: quad shaders not found, using glDrawPixels" << std::endl;
+		return false;
+	}
+
+	quad.CreateQuad();
+	return true;
+}
+
+void FramebufferPresenter::Release()
+{
+	if (!pbos.empty())
+	{
+		glDeleteBuffers((GLsizei)pbos.size(), &pbos[0]);
+		pbos.clear();
+	}
+	if (texture.texture_id != 0)
+		texture.Clear();
+	width = height = bytes_per_pixel = 0;
+	full_upload = true;
+}
+
+// (Re)creates the texture and the PBOs with the size and format of the framebuffer
+void FramebufferPresenter::Resize(const Image& framebuffer)
+{
+	Release();
+
+	width = framebuffer.width;
+	height = framebuffer.height;
+	bytes_per_pixel = framebuffer.bytes_per_pixel;
+	GLenum format = bytes_per_pixel == 4 ? GL_RGBA : GL_RGB;
+
+	texture.Create(width, height, format, GL_UNSIGNED_BYTE, false);
+	texture.Upload(format, GL_UNSIGNED_BYTE, false, NULL, bytes_per_pixel == 4 ? GL_RGBA8 : GL_RGB8);	// Only allocates the storage
+
+	// Exact pixels, the quad covers the whole viewport
+	glBindTexture(GL_TEXTURE_2D, texture.texture_id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// Pixel buffer objects are core since OpenGL 2.1
+	if (GLEW_VERSION_2_1 || GLEW_ARB_pixel_buffer_object)
+	{
+		pbos.resize(num_buffers);
+		glGenBuffers(num_buffers, &pbos[0]);
+		for (int i = 0; i < num_buffers; ++i)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[i]);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)width * height * bytes_per_pixel, NULL, GL_STREAM_DRAW);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+
+	full_upload = true;
+}
+
+// Copies the rows [y0, y1] to the texture
+void FramebufferPresenter::UploadRows(const Image& framebuffer, int y0, int y1)
+{
+	const size_t row_size = (size_t)width * bytes_per_pixel;
+	const size_t offset = (size_t)y0 * row_size;
+	const size_t size = (size_t)(y1 - y0 + 1) * row_size;
+	const GLenum format = bytes_per_pixel == 4 ? GL_RGBA : GL_RGB;
+	const unsigned char* src = (const unsigned char*)framebuffer.pixels + offset;
+
+	glBindTexture(GL_TEXTURE_2D, texture.texture_id);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, bytes_per_pixel == 4 ? 4 : 1);
+
+	if (pbos.empty())
+	{
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y0, width, y1 - y0 + 1, format, GL_UNSIGNED_BYTE, src);
+	}
+	else
+	{
+		// Next PBO of the ring: the previous one may still be in use by the GPU.
+		// glBufferData with NULL orphans the old storage so mapping it does not have to wait either
+		current_pbo = (current_pbo + 1) % (int)pbos.size();
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[current_pbo]);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, (GLsizeiptr)height * row_size, NULL, GL_STREAM_DRAW);
+
+		unsigned char* dst = (unsigned char*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+		if (dst)
+		{
+			memcpy(dst + offset, src, size);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y0, width, y1 - y0 + 1, format, GL_UNSIGNED_BYTE, (const void*)offset);	// Offset inside the PBO
+		}
+		else
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y0, width, y1 - y0 + 1, format, GL_UNSIGNED_BYTE, src);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	uploaded_rows += y1 - y0 + 1;
+}
+
+void FramebufferPresenter::Present(Image& framebuffer)
+{
+	if (!shader)
+	{
+		framebuffer.Render();
+		return;
+	}
+
+	if (framebuffer.width != width || framebuffer.height != height || framebuffer.bytes_per_pixel != bytes_per_pixel)
+		Resize(framebuffer);
+
+	// Rows to upload: everything, or only the band covered by the dirty rects
+	uploaded_rows = 0;
+	int x0, y0 = 0, x1, y1 = (int)height - 1;
+	bool upload = true;
+	if (!full_upload && framebuffer.track_dirty)
+		upload = framebuffer.GetDirtyBounds(x0, y0, x1, y1);
+
+	if (upload && width > 0 && height > 0)
+		UploadRows(framebuffer, std::max(y0, 0), std::min(y1, (int)height - 1));
+	framebuffer.ClearDirtyRects();
+	full_upload = false;
+
+	// Fullscreen quad (its vertices are already in clip space)
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+	shader->Enable();
+	shader->SetTexture("u_texture", &texture);
+	quad.Render(GL_TRIANGLES);
+	shader->Disable();
+}
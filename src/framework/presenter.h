@@ -0,0 +1,52 @@
+/*
+	+ Presents the CPU framebuffer (an Image) on the screen through a persistent texture, instead of glDrawPixels.
+	+ Every frame the pixels are copied into the next pixel buffer object (PBO) of a small ring and the texture is
+	  updated from it with glTexSubImage2D, so the driver can transfer frame N while the CPU rasterizes frame N+1.
+	  If the image tracks dirty rects only the rows between them are uploaded (and the dirty rects are cleared).
+	+ The texture is drawn with a fullscreen quad using the quad.vs/quad.fs shaders.
+	+ If the shaders cannot be loaded it falls back to Image::Render.
+*/
+
+#pragma once
+
+#include "image.h"
+#include "texture.h"
+#include "shader.h"
+#include "mesh.h"
+
+class FramebufferPresenter
+{
+public:
+	FramebufferPresenter();
+	~FramebufferPresenter();
+
+	// Needs a GL context, num_buffers is the number of PBOs (2 = double buffered, 3 = triple buffered)
+	bool Init(int num_buffers = 2);
+	void Release();
+
+	// Uploads the changed rows of the framebuffer and draws it
+	void Present(Image& framebuffer);
+
+	bool IsReady() const { return shader != NULL; }
+	bool UsesPBOs() const { return !pbos.empty(); }
+
+	// Rows uploaded in the last Present (0 if nothing changed)
+	int GetUploadedRows() const { return uploaded_rows; }
+
+private:
+	Texture texture;
+	Shader* shader;
+	Mesh quad;
+
+	std::vector<GLuint> pbos;
+	int num_buffers;
+	int current_pbo;
+
+	// Size and format of the texture, a different framebuffer forces a full upload
+	unsigned int width, height, bytes_per_pixel;
+	bool full_upload;
+	int uploaded_rows;
+
+	void Resize(const Image& framebuffer);
+	void UploadRows(const Image& framebuffer, int y0, int y1);
+};
@@ -0,0 +1,216 @@
+#include "random.h"
+
+#include <atomic>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define RANDOM_USE_SSE2
+#endif
+
+static std::atomic<uint64_t> global_seed(0x853C49E6748FEA9Bull);
+static std::atomic<uint64_t> thread_counter(0);
+
+// Expands a 64 bit seed into well distributed state words
+static uint64_t SplitMix64(uint64_t& x)
+{
+	uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+static inline uint32_t Rotl(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+Random::Random(uint64_t seed, uint64_t stream)
+{
+	Seed(seed, stream);
+}
+
+void Random::Seed(uint64_t seed, uint64_t stream)
+{
+	uint64_t stream_state = stream;
+	uint64_t x = seed ^ SplitMix64(stream_state);
+	for (int lane = 0; lane < 4; ++lane)
+	{
+		uint64_t a = SplitMix64(x), b = SplitMix64(x);
+		s[0][lane] = (uint32_t)a; s[1][lane] = (uint32_t)(a >> 32);
+		s[2][lane] = (uint32_t)b; s[3][lane] = (uint32_t)(b >> 32);
+		if ((s[0][lane] | s[1][lane] | s[2][lane] | s[3][lane]) == 0)
+			s[0][lane] = 1;		// xoshiro never leaves the all zero state
+	}
+	buffer_index = 4;
+}
+
+#ifdef RANDOM_USE_SSE2
+// One xoshiro128** step in the four lanes. The multiplications by 5 and 9 are shifts and adds (SSE2 has no 32 bit mullo)
+static inline __m128i NextLanes(__m128i& s0, __m128i& s1, __m128i& s2, __m128i& s3)
+{
+	__m128i m5 = _mm_add_epi32(s1, _mm_slli_epi32(s1, 2));
+	__m128i r = _mm_or_si128(_mm_slli_epi32(m5, 7), _mm_srli_epi32(m5, 25));
+	r = _mm_add_epi32(r, _mm_slli_epi32(r, 3));
+
+	__m128i t = _mm_slli_epi32(s1, 9);
+	s2 = _mm_xor_si128(s2, s0);
+	s3 = _mm_xor_si128(s3, s1);
+	s1 = _mm_xor_si128(s1, s2);
+	s0 = _mm_xor_si128(s0, s3);
+	s2 = _mm_xor_si128(s2, t);
+	s3 = _mm_or_si128(_mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21));
+	return r;
+}
+#endif
+
+// Writes the next four values (one per generator)
+void Random::NextBlock(uint32_t* dst)
+{
+#ifdef RANDOM_USE_SSE2
+	__m128i s0 = _mm_loadu_si128((const __m128i*)s[0]), s1 = _mm_loadu_si128((const __m128i*)s[1]);
+	__m128i s2 = _mm_loadu_si128((const __m128i*)s[2]), s3 = _mm_loadu_si128((const __m128i*)s[3]);
+	_mm_storeu_si128((__m128i*)dst, NextLanes(s0, s1, s2, s3));
+	_mm_storeu_si128((__m128i*)s[0], s0); _mm_storeu_si128((__m128i*)s[1], s1);
+	_mm_storeu_si128((__m128i*)s[2], s2); _mm_storeu_si128((__m128i*)s[3], s3);
+#else
+	for (int lane = 0; lane < 4; ++lane)
+	{
+		uint32_t s0 = s[0][lane], s1 = s[1][lane], s2 = s[2][lane], s3 = s[3][lane];
+		dst[lane] = Rotl(s1 * 5, 7) * 9;
+
+		uint32_t t = s1 << 9;
+		s2 ^= s0; s3 ^= s1; s1 ^= s2; s0 ^= s3; s2 ^= t;
+		s3 = Rotl(s3, 11);
+		s[0][lane] = s0; s[1][lane] = s1; s[2][lane] = s2; s[3][lane] = s3;
+	}
+#endif
+}
+
+uint32_t Random::NextUInt()
+{
+	if (buffer_index == 4)
+	{
+		NextBlock(buffer);
+		buffer_index = 0;
+	}
+	return buffer[buffer_index++];
+}
+
+int Random::NextInt(int min, int max)
+{
+	uint32_t n = (uint32_t)max - (uint32_t)min + 1u;		// 0 = the whole 32 bit range
+	uint32_t r = NextUInt();
+	return (int)((uint32_t)min + (n ? (uint32_t)(((uint64_t)r * n) >> 32) : r));
+}
+
+void Random::FillUInt(uint32_t* dst, int count)
+{
+	// First the values left in the buffer, so the sequence is the same as calling NextUInt
+	while (count > 0 && buffer_index < 4)
+	{
+		*dst++ = buffer[buffer_index++];
+		count--;
+	}
+
+#ifdef RANDOM_USE_SSE2
+	// The state stays in registers for the whole loop
+	__m128i s0 = _mm_loadu_si128((const __m128i*)s[0]), s1 = _mm_loadu_si128((const __m128i*)s[1]);
+	__m128i s2 = _mm_loadu_si128((const __m128i*)s[2]), s3 = _mm_loadu_si128((const __m128i*)s[3]);
+	for (; count >= 4; count -= 4, dst += 4)
+		_mm_storeu_si128((__m128i*)dst, NextLanes(s0, s1, s2, s3));
+	_mm_storeu_si128((__m128i*)s[0], s0); _mm_storeu_si128((__m128i*)s[1], s1);
+	_mm_storeu_si128((__m128i*)s[2], s2); _mm_storeu_si128((__m128i*)s[3], s3);
+#else
+	for (; count >= 4; count -= 4, dst += 4)
+		NextBlock(dst);
+#endif
+
+	for (; count > 0; --count)
+		*dst++ = NextUInt();
+}
+
+void Random::FillInt(int* dst, int count, int min, int max)
+{
+	const uint32_t n = (uint32_t)max - (uint32_t)min + 1u;
+	uint32_t values[64];
+
+	while (count > 0)
+	{
+		const int block = count < 64 ? count : 64;
+		FillUInt(values, block);
+
+		int i = 0;
+#ifdef RANDOM_USE_SSE2
+		if (n != 0)
+		{
+			// (r * n) >> 32 with two 32x32->64 multiplications (even and odd lanes)
+			const __m128i vn = _mm_set1_epi32((int)n), vmin = _mm_set1_epi32(min);
+			const __m128i high_mask = _mm_set_epi32(-1, 0, -1, 0);
+			for (; i + 4 <= block; i += 4)
+			{
+				__m128i r = _mm_loadu_si128((const __m128i*)(values + i));
+				__m128i even = _mm_srli_epi64(_mm_mul_epu32(r, vn), 32);
+				__m128i odd = _mm_and_si128(_mm_mul_epu32(_mm_srli_epi64(r, 32), vn), high_mask);
+				_mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi32(_mm_or_si128(even, odd), vmin));
+			}
+		}
+#endif
+		for (; i < block; ++i)
+			dst[i] = (int)((uint32_t)min + (n ? (uint32_t)(((uint64_t)values[i] * n) >> 32) : values[i]));
+
+		dst += block;
+		count -= block;
+	}
+}
+
+void Random::FillFloat(float* dst, int count, float min, float max)
+{
+	const float scale = 1.0f / 16777216.0f;
+	const float range = max - min;
+	uint32_t values[64];
+
+	while (count > 0)
+	{
+		const int block = count < 64 ? count : 64;
+		FillUInt(values, block);
+
+		// Same operations as NextFloat(min, max), so both give the same numbers
+		int i = 0;
+#ifdef RANDOM_USE_SSE2
+		const __m128 vscale = _mm_set1_ps(scale), vrange = _mm_set1_ps(range), vmin = _mm_set1_ps(min);
+		for (; i + 4 <= block; i += 4)
+		{
+			__m128 f = _mm_cvtepi32_ps(_mm_srli_epi32(_mm_loadu_si128((const __m128i*)(values + i)), 8));
+			_mm_storeu_ps(dst + i, _mm_add_ps(vmin, _mm_mul_ps(_mm_mul_ps(f, vscale), vrange)));
+		}
+#endif
+		for (; i < block; ++i)
+			dst[i] = min + ((values[i] >> 8) * scale) * range;
+
+		dst += block;
+		count -= block;
+	}
+}
+
+Random& Random::ThreadLocal()
+{
+	// Every thread gets its own stream the first time it asks for its generator
+	static thread_local Random random(global_seed.load(), thread_counter++);
+	return random;
+}
+
+void Random::SetGlobalSeed(uint64_t seed)
+{
+	// The calling thread restarts with stream 0 and the threads that have not used their generator yet take the next ones
+	global_seed = seed;
+	thread_counter = 1;
+	ThreadLocal().Seed(seed, 0);
+}
+
+uint32_t Random::Hash(uint32_t x)
+{
+	x ^= x >> 16; x *= 0x7FEB352Du;
+	x ^= x >> 15; x *= 0x846CA68Bu;
+	x ^= x >> 16;
+	return x;
+}
@@ -0,0 +1,44 @@
+/*
+	+ Small seedable random number generator to replace rand() (slow, global state, not thread-safe).
+	+ Every Random object has its own state, so each thread or each particle emitter can use its own one without locks.
+	+ It runs four xoshiro128** generators side by side (one per SSE2 lane), so the Fill functions generate four values per step.
+	  The values come out in the same order whether they are taken one by one or in batches.
+	+ The same seed (and stream) always gives the same sequence, on every platform and with or without SSE2.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+class Random
+{
+public:
+	// Different streams of the same seed give independent sequences (e.g. one stream per thread or per block of work)
+	Random(uint64_t seed = 0x853C49E6748FEA9Bull, uint64_t stream = 0);
+
+	void Seed(uint64_t seed, uint64_t stream = 0);
+
+	uint32_t NextUInt();
+	int NextInt(int min, int max);						// Uniform in [min, max]
+	float NextFloat() { return (NextUInt() >> 8) * (1.0f / 16777216.0f); }		// Uniform in [0, 1)
+	float NextFloat(float min, float max) { return min + NextFloat() * (max - min); }	// Uniform in [min, max)
+
+	// Batch generation (SIMD when available)
+	void FillUInt(uint32_t* dst, int count);
+	void FillInt(int* dst, int count, int min, int max);
+	void FillFloat(float* dst, int count, float min = 0.0f, float max = 1.0f);
+
+	// Generator of the calling thread, seeded with the global seed and the order in which threads first use it
+	static Random& ThreadLocal();
+	static void SetGlobalSeed(uint64_t seed);
+
+	// Stateless generator for counter based sampling: the same x always gives the same well mixed value
+	static uint32_t Hash(uint32_t x);
+
+private:
+	uint32_t s[4][4];		// s[word][lane], the state of the four generators
+	uint32_t buffer[4];		// Last block of four values, used by NextUInt
+	int buffer_index;		// Next value of buffer (4 = empty)
+
+	void NextBlock(uint32_t* dst);
+};
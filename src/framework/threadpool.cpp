@@ -0,0 +1,98 @@
+#include "threadpool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int num_threads)
+{
+	job = NULL;
+	job_count = 0;
+	next_index = 0;
+	generation = 0;
+	busy_workers = 0;
+	stopping = false;
+
+	if (num_threads <= 0)
+		num_threads = std::max(1, (int)std::thread::hardware_concurrency());
+
+	for (int i = 1; i < num_threads; ++i)
+		workers.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	work_ready.notify_all();
+
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+}
+
+ThreadPool* ThreadPool::Get()
+{
+	static ThreadPool pool;
+	return &pool;
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int, int)>& job)
+{
+	if (count <= 0)
+		return;
+
+	// Not worth waking up the workers, or they are already working for somebody else
+	std::unique_lock<std::mutex> parallel_lock(parallel_mutex, std::try_to_lock);
+	if (workers.empty() || count == 1 || !parallel_lock.owns_lock())
+	{
+		for (int i = 0; i < count; ++i)
+			job(i, 0);
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		this->job = &job;
+		job_count = count;
+		next_index = 0;
+		busy_workers = (int)workers.size();
+		generation++;
+	}
+	work_ready.notify_all();
+
+	// The calling thread also works
+	RunJob(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	work_done.wait(lock, [this] { return busy_workers == 0; });
+	this->job = NULL;
+}
+
+void ThreadPool::WorkerLoop(int thread_index)
+{
+	int last_generation = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			work_ready.wait(lock, [&] { return stopping || generation != last_generation; });
+			if (stopping)
+				return;
+			last_generation = generation;
+		}
+
+		RunJob(thread_index);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (--busy_workers == 0)
+			work_done.notify_one();
+	}
+}
+
+// Takes indices until there are no more left
+void ThreadPool::RunJob(int thread_index)
+{
+	for (int i = next_index++; i < job_count; i = next_index++)
+		(*job)(i, thread_index);
+}
@@ -0,0 +1,48 @@
+/*
+	+ A pool of worker threads used to split loops between all the cores of the machine.
+	+ The threads are created once and sleep while there is no work, so a ParallelFor per frame is cheap.
+*/
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+class ThreadPool
+{
+public:
+	// num_threads = 0 uses all the hardware threads (the thread calling ParallelFor counts as one of them)
+	ThreadPool(int num_threads = 0);
+	~ThreadPool();
+
+	int GetNumThreads() const { return (int)workers.size() + 1; }
+
+	// Calls job(index, thread_index) for every index in [0, count) and waits until all of them have finished.
+	// thread_index is in [0, GetNumThreads()) so it can be used to access per-thread data.
+	// If the pool is already busy (a call from inside a job or from another thread) the loop runs serially in the caller.
+	void ParallelFor(int count, const std::function<void(int index, int thread_index)>& job);
+
+	// Pool shared by the whole framework
+	static ThreadPool* Get();
+
+private:
+	std::vector<std::thread> workers;
+	std::mutex parallel_mutex;		// Held by the thread running a ParallelFor
+	std::mutex mutex;
+	std::condition_variable work_ready;
+	std::condition_variable work_done;
+
+	const std::function<void(int, int)>* job;
+	int job_count;
+	std::atomic<int> next_index;
+	int generation;		// Incremented on every ParallelFor so the workers know there is new work
+	int busy_workers;
+	bool stopping;
+
+	void WorkerLoop(int thread_index);
+	void RunJob(int thread_index);
+};
@@ -0,0 +1,178 @@
+#include "tilerenderer.h"
+
+// Image that draws into the pixels of another one without owning them,
+// so every tile can have its own clip rect while all of them share the framebuffer
+struct ImageView : public Image
+{
+	ImageView(Image& target)
+	{
+		width = target.width;
+		height = target.height;
+		bytes_per_pixel = target.bytes_per_pixel;
+		pixels = target.pixels;
+		triangle_rasterizer = target.triangle_rasterizer;
+	}
+
+	~ImageView() { pixels = NULL; }
+};
+
+TileRenderer::TileRenderer(ThreadPool* pool)
+{
+	this->pool = pool ? pool : ThreadPool::Get();
+}
+
+void TileRenderer::Fill(const Color& c)
+{
+	Command cmd;
+	cmd.type = CMD_FILL;
+	cmd.color = c;
+	cmd.min_x = cmd.min_y = INT_MIN;
+	cmd.max_x = cmd.max_y = INT_MAX;
+	commands.push_back(cmd);
+}
+
+void TileRenderer::DrawLineDDA(int x0, int y0, int x1, int y1, const Color& c)
+{
+	Command cmd;
+	cmd.type = CMD_LINE;
+	cmd.x0 = x0; cmd.y0 = y0;
+	cmd.x1 = x1; cmd.y1 = y1;
+	cmd.color = c;
+	cmd.min_x = std::min(x0, x1); cmd.max_x = std::max(x0, x1);
+	cmd.min_y = std::min(y0, y1); cmd.max_y = std::max(y0, y1);
+	commands.push_back(cmd);
+}
+
+void TileRenderer::DrawRect(int x, int y, int w, int h, const Color& borderColor, int borderWidth, bool isFilled, const Color& fillColor)
+{
+	Command cmd;
+	cmd.type = CMD_RECT;
+	cmd.x0 = x; cmd.y0 = y;
+	cmd.x1 = w; cmd.y1 = h;
+	cmd.color = borderColor;
+	cmd.fill_color = fillColor;
+	cmd.border_width = borderWidth;
+	cmd.filled = isFilled;
+
+	// The border grows borderWidth - 1 pixels outwards, the fill stays inside [x, x + w) x [y, y + h)
+	int e = std::max(borderWidth - 1, 0);
+	cmd.min_x = std::min(x, x + w) - e; cmd.max_x = std::max(x, x + w) + e;
+	cmd.min_y = std::min(y, y + h) - e; cmd.max_y = std::max(y, y + h) + e;
+	if (borderWidth <= 0 && !isFilled)
+		return;
+	commands.push_back(cmd);
+}
+
+void TileRenderer::DrawTriangle(const Vector2& p0, const Vector2& p1, const Vector2& p2, const Color& borderColor, bool isFilled, const Color& fillColor)
+{
+	Command cmd;
+	cmd.type = CMD_TRIANGLE;
+	cmd.p0 = p0; cmd.p1 = p1; cmd.p2 = p2;
+	cmd.color = borderColor;
+	cmd.fill_color = fillColor;
+	cmd.filled = isFilled;
+
+	// Same truncation as Image::DrawTriangle, nothing is drawn outside the box of the vertices
+	int x0 = (int)p0.x, y0 = (int)p0.y;
+	int x1 = (int)p1.x, y1 = (int)p1.y;
+	int x2 = (int)p2.x, y2 = (int)p2.y;
+	cmd.min_x = std::min(x0, std::min(x1, x2)); cmd.max_x = std::max(x0, std::max(x1, x2));
+	cmd.min_y = std::min(y0, std::min(y1, y2)); cmd.max_y = std::max(y0, std::max(y1, y2));
+	commands.push_back(cmd);
+}
+
+void TileRenderer::DrawCircle(int x0, int y0, int r, const Color& borderColor, int borderWidth, bool isFilled, const Color& fillColor)
+{
+	Command cmd;
+	cmd.type = CMD_CIRCLE;
+	cmd.x0 = x0; cmd.y0 = y0;
+	cmd.x1 = r;
+	cmd.color = borderColor;
+	cmd.fill_color = fillColor;
+	cmd.border_width = borderWidth;
+	cmd.filled = isFilled;
+
+	// The border draws radii r .. r + borderWidth - 1 and the fill radii 0 .. r - 1
+	int radius = std::max(r + borderWidth - 1, isFilled ? r - 1 : -1);
+	if (radius < 0)
+		return;
+	cmd.min_x = x0 - radius; cmd.max_x = x0 + radius;
+	cmd.min_y = y0 - radius; cmd.max_y = y0 + radius;
+	commands.push_back(cmd);
+}
+
+void TileRenderer::Execute(const Command& cmd, Image& target, int tile_x0, int tile_y0, int tile_x1, int tile_y1) const
+{
+	switch (cmd.type)
+	{
+	case CMD_FILL:
+		target.FillRect(tile_x0, tile_y0, tile_x1 - tile_x0 + 1, tile_y1 - tile_y0 + 1, cmd.color);
+		break;
+	case CMD_LINE:
+		target.DrawLineDDA(cmd.x0, cmd.y0, cmd.x1, cmd.y1, cmd.color);
+		break;
+	case CMD_RECT:
+		target.DrawRect(cmd.x0, cmd.y0, cmd.x1, cmd.y1, cmd.color, cmd.border_width, cmd.filled, cmd.fill_color);
+		break;
+	case CMD_TRIANGLE:
+		target.DrawTriangle(cmd.p0, cmd.p1, cmd.p2, cmd.color, cmd.filled, cmd.fill_color);
+		break;
+	case CMD_CIRCLE:
+		target.DrawCircle(cmd.x0, cmd.y0, cmd.x1, cmd.color, cmd.border_width, cmd.filled, cmd.fill_color);
+		break;
+	}
+}
+
+void TileRenderer::Render(Image& framebuffer)
+{
+	const int W = (int)framebuffer.width;
+	const int H = (int)framebuffer.height;
+	if (commands.empty() || W <= 0 || H <= 0)
+	{
+		commands.clear();
+		return;
+	}
+
+	const int tiles_x = (W + TILE_SIZE - 1) / TILE_SIZE;
+	const int tiles_y = (H + TILE_SIZE - 1) / TILE_SIZE;
+	const int num_tiles = tiles_x * tiles_y;
+
+	if ((int)bins.size() < num_tiles)
+		bins.resize(num_tiles);
+	for (int i = 0; i < num_tiles; ++i)
+		bins[i].clear();
+
+	// Binning: every command goes to the tiles its bounding box overlaps (in order, so tiles keep the draw order)
+	for (int i = 0; i < (int)commands.size(); ++i)
+	{
+		const Command& cmd = commands[i];
+		int min_x = std::max(cmd.min_x, 0), max_x = std::min(cmd.max_x, W - 1);
+		int min_y = std::max(cmd.min_y, 0), max_y = std::min(cmd.max_y, H - 1);
+		if (min_x > max_x || min_y > max_y)
+			continue;
+		framebuffer.MarkDirty(min_x, min_y, max_x, max_y);		// The tiles draw through views, so the framebuffer is marked here
+
+		for (int ty = min_y / TILE_SIZE; ty <= max_y / TILE_SIZE; ++ty)
+			for (int tx = min_x / TILE_SIZE; tx <= max_x / TILE_SIZE; ++tx)
+				bins[ty * tiles_x + tx].push_back(i);
+	}
+
+	// Every tile is rasterized by a single thread, tiles never overlap so no synchronization is needed
+	pool->ParallelFor(num_tiles, [&](int tile, int thread_index) {
+		const std::vector<int>& bin = bins[tile];
+		if (bin.empty())
+			return;
+
+		int x0 = (tile % tiles_x) * TILE_SIZE;
+		int y0 = (tile / tiles_x) * TILE_SIZE;
+		int x1 = std::min(x0 + TILE_SIZE, W) - 1;
+		int y1 = std::min(y0 + TILE_SIZE, H) - 1;
+
+		ImageView view(framebuffer);
+		view.SetClipRect(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+		for (size_t i = 0; i < bin.size(); ++i)
+			Execute(commands[bin[i]], view, x0, y0, x1, y1);
+	});
+
+	commands.clear();
+}
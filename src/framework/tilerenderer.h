@@ -0,0 +1,56 @@
+/*
+	+ Records drawing calls of an Image in a command list and rasterizes them in parallel.
+	+ Every command is binned into the screen tiles its bounding box touches, then each tile is drawn
+	  by one thread with the Image clip rect set to the tile. Commands are replayed in the order they
+	  were recorded, so the result is the same as drawing them directly in the Image, pixel for pixel.
+*/
+
+#pragma once
+
+#include "image.h"
+#include "threadpool.h"
+
+class TileRenderer
+{
+public:
+	static const int TILE_SIZE = 64;
+
+	// If pool is NULL the shared ThreadPool::Get() is used
+	TileRenderer(ThreadPool* pool = NULL);
+
+	// Same drawing functions as Image, they are only recorded until Render is called
+	void Fill(const Color& c);
+	void DrawLineDDA(int x0, int y0, int x1, int y1, const Color& c);
+	void DrawRect(int x, int y, int w, int h, const Color& borderColor, int borderWidth, bool isFilled, const Color& fillColor);
+	void DrawTriangle(const Vector2& p0, const Vector2& p1, const Vector2& p2, const Color& borderColor, bool isFilled, const Color& fillColor);
+	void DrawCircle(int x0, int y0, int r, const Color& borderColor, int borderWidth, bool isFilled, const Color& fillColor);
+
+	int GetNumCommands() const { return (int)commands.size(); }
+
+	// Discards the recorded commands
+	void Clear() { commands.clear(); }
+
+	// Rasterizes all the recorded commands into the framebuffer (using its triangle_rasterizer) and clears the list.
+	// If the framebuffer tracks dirty rects the bounding box of every command is marked.
+	void Render(Image& framebuffer);
+
+private:
+	enum CommandType { CMD_FILL, CMD_LINE, CMD_RECT, CMD_TRIANGLE, CMD_CIRCLE };
+
+	struct Command {
+		CommandType type;
+		int x0, y0, x1, y1;			// Line endpoints, rect position and size or circle center and radius
+		Vector2 p0, p1, p2;			// Triangle vertices
+		Color color;
+		Color fill_color;
+		int border_width;
+		bool filled;
+		int min_x, min_y, max_x, max_y;	// Conservative bounding box (included) used for binning
+	};
+
+	ThreadPool* pool;
+	std::vector<Command> commands;
+	std::vector< std::vector<int> > bins;	// Indices of the commands that touch every tile (kept between frames to avoid allocations)
+
+	void Execute(const Command& cmd, Image& target, int tile_x0, int tile_y0, int tile_x1, int tile_y1) const;
+};
@@ -224,6 +224,38 @@ void launchLoop(Application* app)
 	return;
 }
 
+// The application loop without window (app must be created as headless)
+bool launchHeadlessLoop(Application* app, int frames, float dt, const char* output_prefix, FrameCallback callback, void* user_data)
+{
+	char filename[1024];
+
+	app->time = 0.f;
+
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		// Render frame (only in the CPU framebuffer)
+		app->Render();
+
+		// Send the frame to the sinks
+		if (output_prefix)
+		{
+			snprintf(filename, sizeof(filename), "%s%05d.tga", output_prefix, frame);
+			if (!app->framebuffer.SaveTGA(filename, false))
+			{
+				std::cerr << "Could not save the frame: " << filename << std::endl;
+				return false;
+			}
+		}
+		if (callback)
+			callback(app->framebuffer, frame, user_data);
+
+		// Update logic with a fixed timestep
+		app->time += dt;
+		app->Update(dt);
+	}
+	return true;
+}
+
 std::vector<std::string> tokenize(const std::string& source, const char* delimiters, bool process_strings)
 {
 	std::vector<std::string> tokens;
@@ -5,6 +5,7 @@
 #pragma once
 
 #include "framework.h"
+#include "random.h"
 #include "SDL.h"
 #include <string>
 
@@ -18,15 +19,14 @@ bool checkGLErrors();
 SDL_Window* createWindow(const char* caption, int width, int height);
 void launchLoop(Application* app);
 
-//fast random generator
-inline unsigned long frand(void) {          //period 2^96-1
-	unsigned long t;
-	static unsigned long x = 123456789, y = 362436069, z = 521288629;
-	x ^= x << 16; x ^= x >> 5; x ^= x << 1;
-	t = x; x = y;y = z;
-	z = t ^ x ^ y;
-	return z;
-}
+//headless loop: renders a fixed number of frames with a fixed timestep, without window nor vsync
+//every frame is saved as <output_prefix>00000.tga (if output_prefix is given) and passed to the callback (if any)
+//returns false if a frame could not be saved (the loop stops there)
+typedef void (*FrameCallback)(const Image& frame, int frame_index, void* user_data);
+bool launchHeadlessLoop(Application* app, int frames, float dt, const char* output_prefix = NULL, FrameCallback callback = NULL, void* user_data = NULL);
+
+//fast random generator (every thread has its own state, see Random::ThreadLocal)
+inline unsigned long frand(void) { return Random::ThreadLocal().NextUInt(); }
 
 inline bool isPowerOfTwo(int n) { return (n & (n - 1)) == 0; }
 inline float randomValue() { return (frand() % 10000) / 10000.0f; }
@@ -3,8 +3,40 @@
 
 int main(int argc, char **argv)
 {
+	// Headless mode: ComputerGraphics --headless <frames> [--dt <seconds>] [--mode <n>] [--filled] [--size <w> <h>] [--output <prefix>]
+	int headless_frames = -1;
+	float headless_dt = 1.0f / 60.0f;
+	int headless_mode = 0;
+	bool headless_filled = false;
+	int width = 1280, height = 720;
+	const char* output_prefix = NULL;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) headless_frames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--dt") == 0 && i + 1 < argc) headless_dt = (float)atof(argv[++i]);
+		else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) headless_mode = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--filled") == 0) headless_filled = true;
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) output_prefix = argv[++i];
+		else if (strcmp(argv[i], "--size") == 0 && i + 2 < argc) { width = atoi(argv[++i]); height = atoi(argv[++i]); }
+	}
+
+	if (headless_frames >= 0)
+	{
+		Application* app = new Application("Computer Graphics", width, height, true);
+		app->Init();
+		app->SetMode(headless_mode);
+		app->isFilled = headless_filled;
+
+		std::cout << "Rendering " << headless_frames << " headless frames..." << std::endl;
+		bool ok = launchHeadlessLoop(app, headless_frames, headless_dt, output_prefix);
+
+		delete app;
+		return ok ? 0 : 1;
+	}
+
 	// Launch the app (app is a global variable)
-	Application* app = new Application( "Computer Graphics", 1280, 720);
+	Application* app = new Application( "Computer Graphics", width, height);
 	app->Init();
 
 	std::cout << "Starting loop..." << std::endl;